@@ -0,0 +1,38 @@
+// bfloat16 storage type: the upper 16 bits of an IEEE single precision float
+// values are only stored as bf16; all arithmetic is done after widening to float
+
+#ifndef _BF16
+#define _BF16
+
+#include <stdint.h>
+#include <string.h>
+
+typedef uint16_t bf16;
+
+// widen bf16 to float (exact)
+inline float bf16_to_float(bf16 x) {
+  uint32_t u = ((uint32_t) x) << 16;
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+// narrow float to bf16, rounding to nearest even (NaN stays NaN)
+inline bf16 float_to_bf16(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  if ((u & 0x7fffffff) > 0x7f800000) {
+    return (bf16) ((u >> 16) | 0x0040);
+  }
+  u += 0x7fff + ((u >> 16) & 1);
+  return (bf16) (u >> 16);
+}
+
+// narrow n floats from x into y
+inline void float_to_bf16(int n, const float* x, bf16* y) {
+  for (int i = 0; i < n; i++) {
+    y[i] = float_to_bf16(x[i]);
+  }
+}
+
+#endif
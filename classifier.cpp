@@ -8,7 +8,13 @@
 #include <random>
 #include <cstdlib>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
 #include "classifier.h"
+#include "prefetch.h"
+#include "vmath.h"
 
 // timer
 #ifdef USE_MPI
@@ -27,8 +33,8 @@ int myrandom(int i) {
 
 // argmax function 
 // returns argmax of values, which has length len
-unsigned int argmax(int len, double* values) {
-  double current_max;
+unsigned int argmax(int len, real* values) {
+  real current_max;
   unsigned int current_arg = 0;
   current_max = values[0];
   for (int i = 0; i < len; i++) {
@@ -41,13 +47,241 @@ unsigned int argmax(int len, double* values) {
 }
 
 // constructor : passes through to Net
-Classifier::Classifier(std::vector< std::vector <int> > config) : Net(config) {};
+Classifier::Classifier(std::vector< std::vector <int> > config) : Net(config), 
+      num_threads(1), sharded(0), wait_time(0), 
+      train_loss(0), train_correct(0), train_accuracy(0) {
+  workers = new Net*[1];
+  workers[0] = this;
+#ifdef USE_MPI
+  hook_count = 0;
+  layers_reported = 0;
+#endif
+}
 
 // destructor
-Classifier::~Classifier() {};
+Classifier::~Classifier() {
+  for (int t = 1; t < num_threads; t++) {
+    delete workers[t];
+  }
+  delete[] workers;
+}
+
+// set number of worker threads
+// call after all layers have been added
+void Classifier::set_threads(int num_threads) {
+  for (int t = 1; t < this->num_threads; t++) {
+    delete workers[t];
+  }
+  delete[] workers;
+  this->num_threads = std::max(num_threads, 1);
+  workers = new Net*[this->num_threads];
+  workers[0] = this;
+  for (int t = 1; t < this->num_threads; t++) {
+    workers[t] = replicate();
+  }
+#ifdef USE_MPI
+  set_overlap(overlap);
+#endif
+}
+
+#ifdef USE_MPI
+// set overlap of reduction with backward propagation
+// the modules of all workers report their layers to this network
+void Classifier::set_overlap(int overlap) {
+  Net::set_overlap(overlap);
+  hook_index.clear();
+  hook_layers.clear();
+  hook_count = 0;
+  for (int i = 0; i < num_modules; i++) {
+    hook_count += M[i]->num_layers;
+  }
+  for (int t = 0; t < num_threads; t++) {
+    int k = 0;
+    for (int i = num_modules - 1; i >= 0; i--) {
+      Module* W = workers[t]->M[i];
+      W->net = M[i]->net;
+      for (int j = W->num_layers - 1; j >= 0; j--) {
+        hook_index[W->L[j]] = t*hook_count + k++;
+        if (t == 0) hook_layers.push_back(W->L[j]);
+      }
+    }
+  }
+  workers_done.assign(hook_count, 0);
+  layer_summed.assign(hook_count, 0);
+  layers_reported = 0;
+  worker_active.assign(num_threads, 1);
+}
+
+// layer of a worker is complete
+// its partials are final once all workers with samples have completed it,
+// and the last of them to do so sums them into worker 0
+void Classifier::partial_ready(Layer* L) {
+  if (num_threads == 1) {
+    Net::partial_ready(L);
+    return;
+  }
+  int index = hook_index.at(L);
+  int t = index / hook_count;
+  int k = index % hook_count;
+  int done;
+#pragma omp atomic capture seq_cst
+  done = ++workers_done[k];
+  int active = 0;
+  for (int w = 0; w < num_threads; w++) {
+    active += worker_active[w];
+  }
+  if (done == active) {
+    if (L->pars > 0) {
+      long offset = L->partial - workers[t]->partial;
+      for (int w = 1; w < num_threads; w++) {
+        if (!worker_active[w]) continue;
+        real* p = workers[w]->partial + offset;
+        for (int i = 0; i < L->pars; i++) {
+          partial[offset + i] += p[i];
+        }
+      }
+    }
+#pragma omp atomic write seq_cst
+    layer_summed[k] = 1;
+  }
+  reduce_summed(0);
+}
+
+// reduce across ranks the layers summed over workers so far (in order), or 
+// with wait all of them, waiting for the other workers
+// only the main thread communicates, so other threads return right away, and
+// it only waits if each worker has a thread of its own
+void Classifier::reduce_summed(int wait) {
+#ifdef _OPENMP
+  if (omp_get_thread_num() != 0) return;
+  if (omp_get_num_threads() != num_threads) wait = 0;
+#endif
+  while (layers_reported < hook_count) {
+    int summed;
+#pragma omp atomic read seq_cst
+    summed = layer_summed[layers_reported];
+    if (summed) {
+      Net::partial_ready(hook_layers[layers_reported]);
+      layers_reported++;
+    }
+    else if (!wait) break;
+  }
+}
+#endif
+
+// Softmax output layer of network, which also computes the loss (NULL if the
+// network does not end in one)
+static Softmax* output_layer(Net* N) {
+  Module* M = N->M[N->num_modules-1];
+  if (M->num_layers == 0 || M->layer_types[M->num_layers-1] != SOFTMAX) return NULL;
+  return (Softmax*) M->L[M->num_layers-1];
+}
+
+// accumulate partial derivatives for a batch
+// each worker runs forward and backward propagation on a contiguous slice of
+// the batch; partials of the workers are then summed pairwise (tree reduction)
+// into worker 0, which is this network
+void Classifier::accumulate_partial(real* in, unsigned int* labels, real* out, int batch) {
+  int ins  = module_sizes[0];
+  int outs = module_sizes[num_modules];
+
+  // we are training
+  int train = 1;
+
+  // slices of batch for each worker
+  int slice = (batch + num_threads - 1)/num_threads;
+  for (int t = 1; t < num_threads; t++) {
+    if (workers[t]->max_batch < slice) {
+      workers[t]->set_batch(slice);
+    }
+  }
+
+  // loss and number correct of each worker's slice
+  std::vector<double> slice_loss(num_threads, 0);
+  std::vector<int> slice_correct(num_threads, 0);
+
+  // with overlap, workers sum each layer's partials as they complete it
+  int summed = 0;
+#ifdef USE_MPI
+  if (overlap && local_steps == 0 && num_threads > 1) {
+    summed = 1;
+    std::fill(workers_done.begin(), workers_done.end(), 0);
+    std::fill(layer_summed.begin(), layer_summed.end(), 0);
+    layers_reported = 0;
+    for (int t = 0; t < num_threads; t++) {
+      worker_active[t] = ( ((long) batch*(t+1))/num_threads > ((long) batch*t)/num_threads );
+    }
+  }
+#endif
+
+#pragma omp parallel for num_threads(num_threads) schedule(static,1)
+  for (int t = 0; t < num_threads; t++) {
+    Net* N = workers[t];
+    int is = ((long) batch*t)/num_threads;
+    int ie = ((long) batch*(t+1))/num_threads;
+    int n = ie - is;
+    if (t > 0) N->clear_partial();
+#ifdef USE_MPI
+    if (n == 0 && summed) reduce_summed(1);
+#endif
+    if (n == 0) continue;
+
+    // step 1: forward propagation
+    // a Softmax output layer given the labels also computes the loss, and 
+    // leaves the partials of the loss with respect to its outputs in z
+    Softmax* head = output_layer(N);
+    if (head != NULL) head->labels = labels + is;
+    N->forward(in + is*ins, train, n);
+
+    // step 2: backward propagation
+    // output, which we feed back; put in last component of delta
+    real* o = N->z[num_modules];
+    if (head != NULL) {
+      head->labels = NULL;
+      slice_loss[t] = head->loss;
+      slice_correct[t] = head->correct;
+    }
+    else {
+      o = out + is*outs;
+      for (int i = 0; i < n; i++) {
+        for (int j = 0; j < outs; j++) {
+          o[ i*outs + j ] = N->z[num_modules][ i*outs + j ] - ((unsigned int) j == labels[is+i]);
+        }
+      }
+    }
+    N->backward(o, n);
+
+    // step 3: accumulate parameter partials using results of backpropagation
+    N->partial_param(n);
+#ifdef USE_MPI
+    // reduce the layers other workers complete after this one
+    if (summed) reduce_summed(1);
+#endif
+  }
+  for (int t = 0; t < num_threads; t++) {
+    train_loss += slice_loss[t];
+    train_correct += slice_correct[t];
+  }
+
+  // sum partials: after the round with stride s, worker t (a multiple of 2s)
+  // holds the sum over workers t .. t+2s-1
+  for (int s = 1; s < num_threads && !summed; s *= 2) {
+#pragma omp parallel for num_threads(num_threads) schedule(static,1)
+    for (int t = 0; t < num_threads - s; t += 2*s) {
+      workers[t]->add_partial(workers[t+s]);
+    }
+  }
+
+#ifdef USE_MPI
+  // launch reduction of the layers not reduced during backward
+  if (summed) {
+    start_allreduce();
+  }
+#endif
+}
 
 // cross-entropy loss
-double Classifier::compute_loss(int cnt, double** data, unsigned int* labels) {
+double Classifier::compute_loss(int cnt, const uint8_t* data, unsigned int* labels) {
 
   int numprocs, myid;
 #ifdef USE_MPI
@@ -60,54 +294,78 @@ double Classifier::compute_loss(int cnt, double** data, unsigned int* labels) {
   // start timer
   double start_time = get_time();
 
-  // determine interval for this rank
+  // determine interval for this rank (all of its shard, if sharded)
   int is = ((int) (cnt/numprocs))*myid;
   int ie = ((int) (cnt/numprocs))*(myid+1);
   if (myid == numprocs-1) ie = cnt;
+  if (sharded) {
+    is = 0;
+    ie = cnt;
+  }
+  int total_cnt = cnt;
 
   // running total of number correct
   double my_correct = 0;
   double my_loss = 0;
   double total_correct;
 
-  // we are not training
-  int train = 0;
-
-  // iterate over all samples
-  for (int i = is; i < ie; i++) {
-    // allocate output
-    forward(data[i], train);
-    // increment number correct if classification output from network 
-    // (argmax of probability vector) matches label
-    if ( argmax( module_sizes[num_modules], z[num_modules] ) == labels[i] ) {
-      my_correct += 1;
+  // samples are fed through the network, in batches of up to max_batch, with
+  // the inference plan
+  int ins  = module_sizes[0];
+  int outs = module_sizes[num_modules];
+  real* in = new real[ max_batch*ins ];
+  // probabilities of labels, and their logs
+  real* p = new real[ max_batch ];
+
+  // iterate over all samples, one batch at a time
+  for (int bs = is; bs < ie; bs += max_batch) {
+    int batch = std::min(max_batch, ie - bs);
+    // gather batch into contiguous input
+    for (int b = 0; b < batch; b++) {
+      scale_input(ins, data + (size_t) (bs+b)*ins, in + b*ins);
+    }
+    real* out = infer(in, batch);
+    for (int b = 0; b < batch; b++) {
+      real* prob = out + b*outs;
+      // increment number correct if classification output from network 
+      // (argmax of probability vector) matches label
+      if ( argmax( outs, prob ) == labels[bs+b] ) {
+        my_correct += 1;
+      }
+      p[b] = prob[ labels[bs+b] ];
+    }
+    // update cross-entropy with batch
+    vlog(batch, p, p);
+    for (int b = 0; b < batch; b++) {
+      my_loss -= p[b];
     }
-    // update cross-entropy with sample
-    my_loss -= log( z[num_modules][ labels[i] ] );
   }
+  delete[] in;
+  delete[] p;
 
 #ifdef USE_MPI
   MPI_Allreduce(&my_correct, &total_correct, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
   MPI_Allreduce(&my_loss, &loss, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  if (sharded) MPI_Allreduce(&cnt, &total_cnt, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
 #else
   total_correct = my_correct;
   loss = my_loss;
 #endif
   // accuracy is total correct divide by count
-  accuracy = total_correct/cnt;
+  accuracy = total_correct/total_cnt;
 
   // return total time elapsed
   return get_time() - start_time;
 }
 
 // run one epoch of training using mini-batch stochastic gradient descent
-// cnt:  number of data samples
+// cnt:  number of data samples (in this rank's shard, if sharded)
 // data: array containing data
 // labels: labels corresponding to data
 // lr: learning rate
 // wd: weight decay parameter (unused for now)
 // batch_size: size of each mini-batch
-double Classifier::train_epoch(int cnt, double** data, unsigned int* labels, 
+double Classifier::train_epoch(int cnt, const uint8_t* data, unsigned int* labels, 
                                   double lr, double wd, unsigned int batch_size) {
 
   int numprocs, myid;
@@ -121,81 +379,155 @@ double Classifier::train_epoch(int cnt, double** data, unsigned int* labels,
   // start timer
   double start_time = get_time();
 
-  // we are training
-  int train = 1;
+  // samples of epoch: all of them, split between ranks batch by batch, or with
+  // local SGD, an equal shard of them for each rank, in batches of its own
+  // with sharded data, each rank takes its slice of a batch from its own
+  // shard (going around again if it runs out), and with local SGD all ranks
+  // use as many samples as the smallest shard holds
+  int samples = cnt;
+  int first = 0;
+  int local = 0;
+#ifdef USE_MPI
+  if (sharded) {
+    MPI_Allreduce(&cnt, &samples, 1, MPI_INT, local_steps > 0 ? MPI_MIN : MPI_SUM, 
+        MPI_COMM_WORLD);
+  }
+  if (local_steps > 0) {
+    local = 1;
+    if (!sharded) {
+      samples = cnt/numprocs;
+      first = samples*myid;
+    }
+  }
+#endif
 
   // number of batches
   int this_batch_size;
-  int num_batches = ceil( ((double) cnt) / batch_size );
+  int num_batches = ceil( ((double) samples) / batch_size );
+
+  // largest slice of a batch handled by any one rank
+  int local_batch = local ? batch_size : batch_size/numprocs + batch_size%numprocs;
+  if (local_batch > max_batch) {
+    set_batch(local_batch);
+  }
 
-  // allocate array for vector to feed back into backpropagation
-  double* out = new double[ module_sizes[num_modules] ];
+  // allocate array for batch of vectors to feed back into backpropagation
+  int ins  = module_sizes[0];
+  int outs = module_sizes[num_modules];
+  real* out = new real[ max_batch*outs ];
 
-  // randomly shuffle training samples
+  // randomly shuffle training samples (each rank its own shard, if sharded)
   int* order = new int[cnt];
-  if (myid == 0) {
-    std::srand ( unsigned ( std::time(0) ) );
+  if (myid == 0 || sharded) {
+    std::srand ( unsigned ( std::time(0) ) + myid );
     for (int i = 0; i < cnt; i++) {
       order[i] = i;
     }
     std::random_shuffle(order, order+cnt, myrandom);
   }
+  // next sample of shard
+  int next = 0;
 
 #ifdef USE_MPI
-  MPI_Bcast(order, cnt, MPI_INT, 0, MPI_COMM_WORLD);
+  if (!sharded) MPI_Bcast(order, cnt, MPI_INT, 0, MPI_COMM_WORLD);
 #endif
 
-  // iterate over batches
+  // samples of this rank in each batch: batch b is samples
+  // batch_index[batch_start[b]] .. batch_index[batch_start[b+1]-1]
+  std::vector<int> batch_index;
+  std::vector<int> batch_start(num_batches+1, 0);
+  std::vector<int> batch_sizes(num_batches);
   for (int b = 0; b < num_batches; b++) {
-
-#ifdef PROGRESS
-    if (myid == 0) printf("Batch %d out of %d\n", b, num_batches);
-#endif
-
-    // clear partial derivatives
-    clear_partial();
-
     // if not enough samples left for a full batch, use what we have left
     if (b == num_batches-1) {
-      this_batch_size = cnt - (num_batches-1)*batch_size;
+      this_batch_size = samples - (num_batches-1)*batch_size;
     }
     else {
       this_batch_size = batch_size;
     }
     
-    // compute contributions to paritals from each training sample in batch
     // determine this processor's interval
     int is = ((int) (this_batch_size/numprocs))*myid;
     int ie = ((int) (this_batch_size/numprocs))*(myid+1);
     if (myid == numprocs-1) ie = this_batch_size;
+    if (local) {
+      is = first;
+      ie = first + this_batch_size;
+    }
 
+    // index of each training sample in data array
     for (int i = is; i < ie; i++) {
-      // index of training sample in data array
-      int index = order[ b*batch_size + i ];
-
-      // step 1: forward propagation on training sample
-      forward(data[index], train);
-
-      // step 2: backward propagation
-      // compute output, which we feed back; put in last component of delta
-      unsigned int yj;
-      for (int j = 0; j < module_sizes[num_modules]; j++) {
-        yj = (j == labels[index]);
-        out[j] = z[num_modules][j] - yj;
-      }
-      backward(out);
-
-      // step 3: accumulate parameter partials using results of backpropagation
-      partial_param();
+      batch_index.push_back( (sharded && !local) ? order[ (next++) % cnt ] : order[ b*batch_size + i ] );
     }
+    batch_start[b+1] = batch_index.size();
+    batch_sizes[b] = this_batch_size;
+  }
+
+  // loss and number correct, summed over batches
+  train_loss = 0;
+  train_correct = 0;
+
+  // a producer thread gathers this rank's samples of each batch into a 
+  // contiguous staging buffer, ahead of the batch being trained on
+  Prefetcher prefetch(max_batch, ins);
+  prefetch.start(data, labels, batch_index.data(), batch_start.data(), num_batches);
+
+  // iterate over batches
+  for (int b = 0; b < num_batches; b++) {
+
+#ifdef PROGRESS
+    if (myid == 0) printf("Batch %d out of %d\n", b, num_batches);
+#endif
+
+    // clear partial derivatives
+    clear_partial();
+
+    // steps 1-3: forward propagation, backward propagation and accumulation
+    // of parameter partials, on all training samples in batch
+    int s = prefetch.next();
+    accumulate_partial(prefetch.in[s], prefetch.labels[s], out, prefetch.count[s]);
+    prefetch.release();
 
     // step 4: now that we have finished with our mini-batch, update net parameters
     // using accumulated partial derivatives for entire mini-batch
     // (stochastic gradient descent)
-    update_param(lr, this_batch_size);
+    update_param(lr, batch_sizes[b]);
+    // replicas share the updated parameters, but not anything derived from them
+    for (int t = 1; t < num_threads; t++) {
+      workers[t]->param_changed();
+    }
+  }
+
+#ifdef USE_MPI
+  // with local SGD, end the epoch with parameters averaged over all ranks
+  if (local) {
+    finish_average();
+    if (num_updates % local_steps != 0) {
+      start_average();
+      finish_average();
+    }
+    for (int t = 0; t < num_threads; t++) {
+      workers[t]->param_changed();
+    }
   }
+#endif
+
+  prefetch.finish();
+  wait_time = prefetch.wait_time;
+
+  // loss and accuracy over all samples trained on
+  double trained = batch_start[num_batches];
+#ifdef USE_MPI
+  double sums[3] = { train_loss, train_correct, trained };
+  MPI_Allreduce(MPI_IN_PLACE, sums, 3, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  train_loss = sums[0];
+  train_correct = sums[1];
+  trained = sums[2];
+#endif
+  train_accuracy = (trained > 0) ? train_correct/trained : 0;
 
   delete[] order;
+  delete[] out;
   
   // return total time
   return get_time() - start_time;
@@ -4,6 +4,7 @@
 // loss function is cross-entropy
 
 #include "net.h"
+#include <unordered_map>
 
 #ifndef _CLASSIFIER
 #define _CLASSIFIER
@@ -14,15 +15,70 @@ class Classifier : public Net {
     double accuracy;
     double loss;
 
+    // training worker threads: worker 0 is this network, the others are
+    // replicas sharing its parameters, each with its own layer data and partials
+    int num_threads;
+    Net** workers;
+
+    // data passed to compute_loss and train_epoch is only this rank's shard of
+    // the data set (see mnist_load), rather than all of it
+    int sharded;
+
+    // time train_epoch spent waiting for batches to be gathered (last epoch)
+    double wait_time;
+
+    // cross-entropy loss summed over the samples trained on in the last epoch 
+    // (by all ranks), number of them correct, and accuracy; computed by the 
+    // output layer as it trains (if it is Softmax), at no extra cost, so they 
+    // are for the parameters of each batch and with dropout
+    double train_loss;
+    double train_correct;
+    double train_accuracy;
+
     // constructor and destructor
     Classifier(std::vector< std::vector <int> > config);
     ~Classifier(); 
 
+    // set number of training worker threads (creates replicas)
+    void set_threads(int num_threads);
+
+#ifdef USE_MPI
+    // overlap with more than one worker: the last worker to complete a layer
+    // sums its partials over all workers into worker 0, and the main thread
+    // reduces the layers summed so far across ranks; layers are numbered in
+    // the order backward completes them
+    // (layer of each worker (as t*hook_count + layer), layers of worker 0,
+    // workers done with each layer, layers summed, layers passed on to 
+    // Net::partial_ready, and workers with samples in the batch)
+    std::unordered_map<Layer*, int> hook_index;
+    std::vector<Layer*> hook_layers;
+    int hook_count;
+    std::vector<int> workers_done;
+    std::vector<int> layer_summed;
+    int layers_reported;
+    std::vector<int> worker_active;
+
+    // turn overlap of reduction with backward propagation on or off
+    void set_overlap(int overlap);
+
+    // partials of layer L of a worker are complete (called during backward)
+    void partial_ready(Layer* L);
+
+    // reduce layers summed over workers so far (or with wait, all of them)
+    void reduce_summed(int wait);
+#endif
+
+    // accumulate partial derivatives of loss for a batch of samples in 
+    // [batch x inputs] with labels, split across worker threads, and add
+    // loss and number correct to train_loss and train_correct
+    // out is workspace [batch x outputs] (if the output layer is not Softmax)
+    void accumulate_partial(real* in, unsigned int* labels, real* out, int batch);
+
     // compute cross-entropy loss and accuracy
-    double compute_loss(int cnt, double** data, unsigned int* labels);
+    double compute_loss(int cnt, const uint8_t* data, unsigned int* labels);
 
     // train for one epoch
-    double train_epoch(int cnt, double** data, unsigned int* labels, 
+    double train_epoch(int cnt, const uint8_t* data, unsigned int* labels, 
                           double lr, double wd, unsigned int batch_size);
 };
 
@@ -0,0 +1,537 @@
+// register- and cache-blocked matrix multiply
+//
+// gemm follows the usual packed layout: a KC x NC block of op(B) is packed into
+// panels of GEMM_NR columns, an MC x KC block of op(A) into panels of GEMM_MR
+// rows, and a GEMM_MR x GEMM_NR micro-kernel accumulates a tile of C in vector
+// registers. Transposes are handled entirely by the packing routines, so every
+// combination of op(A), op(B) runs the same unit-stride micro-kernel.
+// Products with a single row or column are routed to gemv, which never packs.
+// An activation can be applied to C by the micro-kernel as it stores the
+// last block of K, so a layer and its activation make one pass over C.
+// With USE_BF16 the same code also runs with B (the weights) stored as bf16:
+// B is widened to float on load and everything accumulates in float.
+
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
+#include "gemm.h"
+
+//
+// vector abstraction (AVX-512, AVX2 + FMA, or scalar fallback) for type real
+//
+
+#if defined(__AVX512F__) && defined(USE_FLOAT)
+  // 16 floats per vector, 8 x 32 micro-kernel
+  #define VLEN 16
+  #define GEMM_MR 8
+  #define GEMM_NV 2
+  typedef __m512 vec;
+  #define vzero()       _mm512_setzero_ps()
+  #define vset1(x)      _mm512_set1_ps(x)
+  #define vload(p)      _mm512_loadu_ps(p)
+  #define vstore(p,v)   _mm512_storeu_ps(p,v)
+  #define vfma(a,b,c)   _mm512_fmadd_ps(a,b,c)
+  #define vadd(a,b)     _mm512_add_ps(a,b)
+  #define vmax(a,b)     _mm512_max_ps(a,b)
+  #define vloadh(p)     _mm512_castsi512_ps(_mm512_slli_epi32( \
+                          _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) (p))), 16))
+  static inline real vsum(vec v) { return _mm512_reduce_add_ps(v); }
+#elif defined(__AVX512F__)
+  // 8 doubles per vector, 8 x 16 micro-kernel
+  #define VLEN 8
+  #define GEMM_MR 8
+  #define GEMM_NV 2
+  typedef __m512d vec;
+  #define vzero()       _mm512_setzero_pd()
+  #define vset1(x)      _mm512_set1_pd(x)
+  #define vload(p)      _mm512_loadu_pd(p)
+  #define vstore(p,v)   _mm512_storeu_pd(p,v)
+  #define vfma(a,b,c)   _mm512_fmadd_pd(a,b,c)
+  #define vadd(a,b)     _mm512_add_pd(a,b)
+  #define vmax(a,b)     _mm512_max_pd(a,b)
+  static inline real vsum(vec v) { return _mm512_reduce_add_pd(v); }
+#elif defined(__AVX2__) && defined(__FMA__) && defined(USE_FLOAT)
+  // 8 floats per vector, 6 x 16 micro-kernel
+  #define VLEN 8
+  #define GEMM_MR 6
+  #define GEMM_NV 2
+  typedef __m256 vec;
+  #define vzero()       _mm256_setzero_ps()
+  #define vset1(x)      _mm256_set1_ps(x)
+  #define vload(p)      _mm256_loadu_ps(p)
+  #define vstore(p,v)   _mm256_storeu_ps(p,v)
+  #define vfma(a,b,c)   _mm256_fmadd_ps(a,b,c)
+  #define vadd(a,b)     _mm256_add_ps(a,b)
+  #define vmax(a,b)     _mm256_max_ps(a,b)
+  #define vloadh(p)     _mm256_castsi256_ps(_mm256_slli_epi32( \
+                          _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (p))), 16))
+  static inline real vsum(vec v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v,1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s,s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s,s,1)));
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  // 4 doubles per vector, 6 x 8 micro-kernel
+  #define VLEN 4
+  #define GEMM_MR 6
+  #define GEMM_NV 2
+  typedef __m256d vec;
+  #define vzero()       _mm256_setzero_pd()
+  #define vset1(x)      _mm256_set1_pd(x)
+  #define vload(p)      _mm256_loadu_pd(p)
+  #define vstore(p,v)   _mm256_storeu_pd(p,v)
+  #define vfma(a,b,c)   _mm256_fmadd_pd(a,b,c)
+  #define vadd(a,b)     _mm256_add_pd(a,b)
+  #define vmax(a,b)     _mm256_max_pd(a,b)
+  static inline real vsum(vec v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v,1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s,s)));
+  }
+#else
+  // scalar fallback, 4 x 4 micro-kernel
+  #define VLEN 1
+  #define GEMM_MR 4
+  #define GEMM_NV 4
+  typedef real vec;
+  #define vzero()       ((real) 0)
+  #define vset1(x)      (x)
+  #define vload(p)      (*(p))
+  #define vstore(p,v)   (*(p) = (v))
+  #define vfma(a,b,c)   ((a)*(b) + (c))
+  #define vadd(a,b)     ((a) + (b))
+  #define vmax(a,b)     ((a) > (b) ? (a) : (b))
+  #define vloadh(p)     bf16_to_float(*(p))
+  static inline real vsum(vec v) { return v; }
+#endif
+
+// loads from matrices stored as real or (with USE_BF16) as bf16, widened to real
+static inline vec vload_any(const real* p) { return vload(p); }
+static inline real widen(real x) { return x; }
+#ifdef USE_BF16
+static inline vec vload_any(const bf16* p) { return vloadh(p); }
+static inline real widen(bf16 x) { return bf16_to_float(x); }
+#endif
+
+// micro-kernel tile width
+#define GEMM_NR (GEMM_NV*VLEN)
+
+// cache blocking: packed B block (KC x NC) targets L2/L3, packed A block (MC x KC) L2
+#define GEMM_KC 256
+#define GEMM_MC (16*GEMM_MR)
+#define GEMM_NC 1024
+
+//
+// level 1 helpers
+//
+
+// y = beta * y
+static void scale(int n, real beta, real* y) {
+  if (beta == 1.0) return;
+  if (beta == 0.0) {
+    std::fill(y, y+n, (real) 0);
+  }
+  else {
+    for (int i = 0; i < n; i++) {
+      y[i] *= beta;
+    }
+  }
+}
+
+// dot product of x (matrix row) and y
+template <typename T>
+static real dot(int n, const T* x, const real* y) {
+  vec s0 = vzero(), s1 = vzero(), s2 = vzero(), s3 = vzero();
+  int i = 0;
+  for (; i + 4*VLEN <= n; i += 4*VLEN) {
+    s0 = vfma(vload_any(x+i),        vload(y+i),        s0);
+    s1 = vfma(vload_any(x+i+VLEN),   vload(y+i+VLEN),   s1);
+    s2 = vfma(vload_any(x+i+2*VLEN), vload(y+i+2*VLEN), s2);
+    s3 = vfma(vload_any(x+i+3*VLEN), vload(y+i+3*VLEN), s3);
+  }
+  for (; i + VLEN <= n; i += VLEN) {
+    s0 = vfma(vload_any(x+i), vload(y+i), s0);
+  }
+  real sum = vsum( vadd( vadd(s0,s1), vadd(s2,s3) ) );
+  for (; i < n; i++) {
+    sum += widen(x[i])*y[i];
+  }
+  return sum;
+}
+
+// y = a*x + y (x is a matrix row)
+template <typename T>
+static void axpy(int n, real a, const T* x, real* y) {
+  if (a == 0.0) return;
+  vec va = vset1(a);
+  int i = 0;
+  for (; i + 2*VLEN <= n; i += 2*VLEN) {
+    vstore(y+i,      vfma(va, vload_any(x+i),      vload(y+i)));
+    vstore(y+i+VLEN, vfma(va, vload_any(x+i+VLEN), vload(y+i+VLEN)));
+  }
+  for (; i + VLEN <= n; i += VLEN) {
+    vstore(y+i, vfma(va, vload_any(x+i), vload(y+i)));
+  }
+  for (; i < n; i++) {
+    y[i] += a*widen(x[i]);
+  }
+}
+
+//
+// packing buffers (one set per thread, allocated on first use)
+//
+
+struct PackBuffers {
+  real* a;
+  real* b;
+  real* v;
+  int vlen;
+  PackBuffers() : a(NULL), b(NULL), v(NULL), vlen(0) {}
+  ~PackBuffers() { free(a); free(b); free(v); }
+
+  real* get_a() {
+    if (a == NULL && posix_memalign((void**) &a, 64, sizeof(real)*GEMM_MC*GEMM_KC) != 0) {
+      a = NULL;
+      throw std::bad_alloc();
+    }
+    return a;
+  }
+  real* get_b() {
+    if (b == NULL && posix_memalign((void**) &b, 64, sizeof(real)*GEMM_KC*GEMM_NC) != 0) {
+      b = NULL;
+      throw std::bad_alloc();
+    }
+    return b;
+  }
+  // scratch vector used to make strided vectors contiguous
+  real* get_v(int n) {
+    if (n > vlen) {
+      free(v);
+      vlen = 0;
+      if (posix_memalign((void**) &v, 64, sizeof(real)*n) != 0) {
+        v = NULL;
+        throw std::bad_alloc();
+      }
+      vlen = n;
+    }
+    return v;
+  }
+};
+
+static thread_local PackBuffers buffers;
+
+// copy strided vector x into contiguous scratch (returns x if already contiguous)
+static const real* contiguous(int n, const real* x, int incx) {
+  if (incx == 1) return x;
+  real* v = buffers.get_v(n);
+  for (int i = 0; i < n; i++) {
+    v[i] = x[i*incx];
+  }
+  return v;
+}
+
+#ifdef USE_BF16
+// widen strided bf16 vector x into contiguous scratch
+static const real* contiguous(int n, const bf16* x, int incx) {
+  real* v = buffers.get_v(n);
+  for (int i = 0; i < n; i++) {
+    v[i] = bf16_to_float(x[i*incx]);
+  }
+  return v;
+}
+#endif
+
+//
+// matrix-vector multiply
+//
+
+template <typename T>
+static void gemv_impl(int trans, int M, int N,
+    real alpha, const T* A, int lda, const real* x,
+    real beta, real* y) {
+  if (trans == GEMM_N) {
+    // y (M) = A x: one dot product per row of A
+    scale(M, beta, y);
+    for (int i = 0; i < M; i++) {
+      y[i] += alpha * dot(N, A + i*lda, x);
+    }
+  }
+  else {
+    // y (N) = A^T x: accumulate rows of A, so A is still read contiguously
+    scale(N, beta, y);
+    for (int i = 0; i < M; i++) {
+      axpy(N, alpha*x[i], A + i*lda, y);
+    }
+  }
+}
+
+void gemv(int trans, int M, int N,
+    real alpha, const real* A, int lda, const real* x,
+    real beta, real* y) {
+  gemv_impl(trans, M, N, alpha, A, lda, x, beta, y);
+}
+
+//
+// packing routines
+//
+
+// pack mc x kc block of op(A) starting at (i0, k0) into panels of GEMM_MR rows
+// each panel is stored k-major: panel[k*GEMM_MR + ii]; rows past mc are zero
+static void pack_a(int trans, const real* A, int lda,
+    int i0, int k0, int mc, int kc, real* buf) {
+  for (int ip = 0; ip < mc; ip += GEMM_MR) {
+    int m = std::min(GEMM_MR, mc - ip);
+    for (int ii = 0; ii < GEMM_MR; ii++) {
+      if (ii < m) {
+        int i = i0 + ip + ii;
+        if (trans == GEMM_N) {
+          const real* a = A + i*lda + k0;
+          for (int k = 0; k < kc; k++) {
+            buf[k*GEMM_MR + ii] = a[k];
+          }
+        }
+        else {
+          const real* a = A + k0*lda + i;
+          for (int k = 0; k < kc; k++) {
+            buf[k*GEMM_MR + ii] = a[k*lda];
+          }
+        }
+      }
+      else {
+        for (int k = 0; k < kc; k++) {
+          buf[k*GEMM_MR + ii] = 0;
+        }
+      }
+    }
+    buf += GEMM_MR*kc;
+  }
+}
+
+// pack kc x nc block of op(B) starting at (k0, j0) into panels of GEMM_NR columns
+// each panel is stored k-major: panel[k*GEMM_NR + jj]; columns past nc are zero
+template <typename T>
+static void pack_b(int trans, const T* B, int ldb,
+    int k0, int j0, int kc, int nc, real* buf) {
+  for (int jp = 0; jp < nc; jp += GEMM_NR) {
+    int n = std::min(GEMM_NR, nc - jp);
+    if (trans == GEMM_N) {
+      // rows of B are contiguous in j
+      for (int k = 0; k < kc; k++) {
+        const T* b = B + (k0+k)*ldb + j0 + jp;
+        for (int jj = 0; jj < n; jj++) {
+          buf[k*GEMM_NR + jj] = widen(b[jj]);
+        }
+        for (int jj = n; jj < GEMM_NR; jj++) {
+          buf[k*GEMM_NR + jj] = 0;
+        }
+      }
+    }
+    else {
+      // rows of B are contiguous in k, so read one row of B per column of panel
+      for (int jj = 0; jj < GEMM_NR; jj++) {
+        if (jj < n) {
+          const T* b = B + (j0+jp+jj)*ldb + k0;
+          for (int k = 0; k < kc; k++) {
+            buf[k*GEMM_NR + jj] = widen(b[k]);
+          }
+        }
+        else {
+          for (int k = 0; k < kc; k++) {
+            buf[k*GEMM_NR + jj] = 0;
+          }
+        }
+      }
+    }
+    buf += GEMM_NR*kc;
+  }
+}
+
+//
+// micro-kernel
+//
+
+// C (GEMM_MR x GEMM_NR tile) += alpha * (packed A panel) * (packed B panel),
+// then C = act(C)
+static inline void kernel(int kc, const real* a, const real* b,
+    real alpha, real* C, int ldc, int act) {
+  vec acc[GEMM_MR][GEMM_NV];
+#pragma GCC unroll 8
+  for (int i = 0; i < GEMM_MR; i++) {
+#pragma GCC unroll 4
+    for (int j = 0; j < GEMM_NV; j++) {
+      acc[i][j] = vzero();
+    }
+  }
+  for (int k = 0; k < kc; k++) {
+    vec bv[GEMM_NV];
+#pragma GCC unroll 4
+    for (int j = 0; j < GEMM_NV; j++) {
+      bv[j] = vload(b + j*VLEN);
+    }
+#pragma GCC unroll 8
+    for (int i = 0; i < GEMM_MR; i++) {
+      vec av = vset1(a[i]);
+#pragma GCC unroll 4
+      for (int j = 0; j < GEMM_NV; j++) {
+        acc[i][j] = vfma(av, bv[j], acc[i][j]);
+      }
+    }
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  vec va = vset1(alpha);
+  if (act == ACT_RELU) {
+#pragma GCC unroll 8
+    for (int i = 0; i < GEMM_MR; i++) {
+#pragma GCC unroll 4
+      for (int j = 0; j < GEMM_NV; j++) {
+        vstore(C + i*ldc + j*VLEN, 
+            vmax(vfma(va, acc[i][j], vload(C + i*ldc + j*VLEN)), vzero()));
+      }
+    }
+    return;
+  }
+#pragma GCC unroll 8
+  for (int i = 0; i < GEMM_MR; i++) {
+#pragma GCC unroll 4
+    for (int j = 0; j < GEMM_NV; j++) {
+      vstore(C + i*ldc + j*VLEN, vfma(va, acc[i][j], vload(C + i*ldc + j*VLEN)));
+    }
+  }
+  if (act == ACT_SIGMOID) {
+    for (int i = 0; i < GEMM_MR; i++) {
+      vsigmoid(GEMM_NR, C + i*ldc, C + i*ldc);
+    }
+  }
+}
+
+// partial tile at the bottom/right edge of C: run kernel on scratch tile and copy
+static void kernel_edge(int m, int n, int kc, const real* a, const real* b,
+    real alpha, real* C, int ldc, int act) {
+  real tile[GEMM_MR*GEMM_NR] = {0};
+  kernel(kc, a, b, alpha, tile, GEMM_NR, ACT_NONE);
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      C[i*ldc + j] += tile[i*GEMM_NR + j];
+    }
+    vactivate(act, n, C + i*ldc);
+  }
+}
+
+// C = act(C) for M x N matrix C
+static void activate(int act, int M, int N, real* C, int ldc) {
+  if (act == ACT_NONE) return;
+  for (int i = 0; i < M; i++) {
+    vactivate(act, N, C + i*ldc);
+  }
+}
+
+//
+// matrix-matrix multiply
+//
+
+// the activation is applied by the micro-kernel as it stores the last block 
+// of K, and by a pass over C after the special cases (which make one pass 
+// over C anyway)
+template <typename T>
+static void gemm_impl(int trans_a, int trans_b, int M, int N, int K,
+    real alpha, const real* A, int lda, const T* B, int ldb,
+    real beta, real* C, int ldc, int act) {
+  if (M <= 0 || N <= 0) return;
+
+  // apply beta to C once; everything below accumulates into C
+  if (beta != 1.0) {
+    for (int i = 0; i < M; i++) {
+      scale(N, beta, C + i*ldc);
+    }
+  }
+  if (K <= 0 || alpha == 0.0) {
+    activate(act, M, N, C, ldc);
+    return;
+  }
+
+  // single row of C: vector times matrix
+  if (M == 1) {
+    const real* a = contiguous(K, A, (trans_a == GEMM_N) ? 1 : lda);
+    if (trans_b == GEMM_N) {
+      gemv_impl(GEMM_T, K, N, alpha, B, ldb, a, 1.0, C);
+    }
+    else {
+      gemv_impl(GEMM_N, N, K, alpha, B, ldb, a, 1.0, C);
+    }
+    activate(act, 1, N, C, ldc);
+    return;
+  }
+
+  // single contiguous column of C: matrix times vector
+  if (N == 1 && ldc == 1) {
+    const real* b = contiguous(K, B, (trans_b == GEMM_N) ? ldb : 1);
+    if (trans_a == GEMM_N) {
+      gemv(GEMM_N, M, K, alpha, A, lda, b, 1.0, C);
+    }
+    else {
+      gemv(GEMM_T, K, M, alpha, A, lda, b, 1.0, C);
+    }
+    activate(act, M, 1, C, ldc);
+    return;
+  }
+
+  // outer product with contiguous rows of op(B): one axpy per row of C
+  if (K == 1 && trans_b == GEMM_N) {
+    for (int i = 0; i < M; i++) {
+      real ai = (trans_a == GEMM_N) ? A[i*lda] : A[i];
+      axpy(N, alpha*ai, B, C + i*ldc);
+    }
+    activate(act, M, N, C, ldc);
+    return;
+  }
+
+  real* pa = buffers.get_a();
+  real* pb = buffers.get_b();
+
+  for (int jc = 0; jc < N; jc += GEMM_NC) {
+    int nc = std::min(GEMM_NC, N - jc);
+    for (int pc = 0; pc < K; pc += GEMM_KC) {
+      int kc = std::min(GEMM_KC, K - pc);
+      // activation once the last block of K is added
+      int a_act = (pc + kc == K) ? act : ACT_NONE;
+      pack_b(trans_b, B, ldb, pc, jc, kc, nc, pb);
+      for (int ic = 0; ic < M; ic += GEMM_MC) {
+        int mc = std::min(GEMM_MC, M - ic);
+        pack_a(trans_a, A, lda, ic, pc, mc, kc, pa);
+        // sweep micro-kernel over the block
+        for (int jr = 0; jr < nc; jr += GEMM_NR) {
+          int n = std::min(GEMM_NR, nc - jr);
+          for (int ir = 0; ir < mc; ir += GEMM_MR) {
+            int m = std::min(GEMM_MR, mc - ir);
+            real* c = C + (ic+ir)*ldc + jc + jr;
+            if (m == GEMM_MR && n == GEMM_NR) {
+              kernel(kc, pa + ir*kc, pb + jr*kc, alpha, c, ldc, a_act);
+            }
+            else {
+              kernel_edge(m, n, kc, pa + ir*kc, pb + jr*kc, alpha, c, ldc, a_act);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void gemm(int trans_a, int trans_b, int M, int N, int K,
+    real alpha, const real* A, int lda, const real* B, int ldb,
+    real beta, real* C, int ldc, int act) {
+  gemm_impl(trans_a, trans_b, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, act);
+}
+
+#ifdef USE_BF16
+void gemm_bf16(int trans_a, int trans_b, int M, int N, int K,
+    real alpha, const real* A, int lda, const bf16* B, int ldb,
+    real beta, real* C, int ldc, int act) {
+  gemm_impl(trans_a, trans_b, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, act);
+}
+#endif
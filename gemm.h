@@ -0,0 +1,41 @@
+// matrix multiply kernels used by the layers
+// all matrices are stored row-major with a leading dimension (row stride)
+
+#ifndef _GEMM
+#define _GEMM
+
+#include "real.h"
+#include "vmath.h"
+
+// transpose flags
+#define GEMM_N 0
+#define GEMM_T 1
+
+// general matrix-matrix multiply
+// C = act(alpha * op(A) * op(B) + beta * C)
+// op(A) is M x K, op(B) is K x N, C is M x N
+// op(X) is X for GEMM_N and X^T for GEMM_T
+// act is an activation (ACT_NONE, ACT_RELU or ACT_SIGMOID, see vmath.h), 
+// applied to each tile of C as its final value is stored
+void gemm(int trans_a, int trans_b, int M, int N, int K,
+    real alpha, const real* A, int lda, const real* B, int ldb,
+    real beta, real* C, int ldc, int act = ACT_NONE);
+
+// general matrix-vector multiply
+// y = alpha * op(A) * x + beta * y
+// A is M x N; y has M entries for GEMM_N and N entries for GEMM_T
+void gemv(int trans, int M, int N,
+    real alpha, const real* A, int lda, const real* x,
+    real beta, real* y);
+
+#ifdef USE_BF16
+#include "bf16.h"
+
+// gemm with B stored as bf16: B is widened to float as it is packed, and
+// products are accumulated in float
+void gemm_bf16(int trans_a, int trans_b, int M, int N, int K,
+    real alpha, const real* A, int lda, const bf16* B, int ldb,
+    real beta, real* C, int ldc, int act = ACT_NONE);
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#include <algorithm>
+
+#include "im2col.h"
+
+// range of output columns j (0 <= j < on) for which input column sn*j + off
+// lies in [0, n); returns empty range (lo >= hi) if there are none
+static inline void valid_range(int off, int sn, int n, int on, int& lo, int& hi) {
+  // smallest j with sn*j + off >= 0
+  lo = (off >= 0) ? 0 : (-off + sn - 1)/sn;
+  // largest j with sn*j + off <= n-1, plus one
+  hi = (n - 1 - off < 0) ? 0 : (n - 1 - off)/sn + 1;
+  hi = std::min(hi, on);
+}
+
+// lower input into matrix for convolution
+// padding is resolved here once per row segment, so the multiply needs no bounds checks
+template <typename T>
+static void lower(const T* x, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, T pad, T* col) {
+  int kh = 2*km+1;
+  int kw = 2*kn+1;
+  int lo, hi;
+  // one row of col per (channel, kernel row, kernel column)
+  for (int ci = 0; ci < c; ci++) {
+    for (int ki = 0; ki < kh; ki++) {
+      for (int kj = 0; kj < kw; kj++) {
+        T* dst = col + ( (ci*kh + ki)*kw + kj )*om*on;
+        valid_range(kj - kn, sn, n, on, lo, hi);
+        for (int i = 0; i < om; i++) {
+          int row = sm*i + ki - km;
+          T* d = dst + i*on;
+          if (row < 0 || row >= m || lo >= hi) {
+            std::fill(d, d + on, pad);
+            continue;
+          }
+          const T* src = x + (ci*m + row)*n + kj - kn;
+          std::fill(d, d + lo, pad);
+          if (sn == 1) {
+            std::copy(src + lo, src + hi, d + lo);
+          }
+          else {
+            for (int j = lo; j < hi; j++) {
+              d[j] = src[sn*j];
+            }
+          }
+          std::fill(d + hi, d + on, pad);
+        }
+      }
+    }
+  }
+}
+
+void im2col(const real* x, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, real* col) {
+  lower(x, c, m, n, km, kn, sm, sn, om, on, (real) 0, col);
+}
+
+void im2col(const uint8_t* x, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, uint8_t pad, uint8_t* col) {
+  lower(x, c, m, n, km, kn, sm, sn, om, on, pad, col);
+}
+
+// scatter lowered matrix back onto input, adding overlapping contributions
+void col2im(const real* col, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, real* x) {
+  int kh = 2*km+1;
+  int kw = 2*kn+1;
+  int lo, hi;
+  for (int ci = 0; ci < c; ci++) {
+    for (int ki = 0; ki < kh; ki++) {
+      for (int kj = 0; kj < kw; kj++) {
+        const real* src = col + ( (ci*kh + ki)*kw + kj )*om*on;
+        valid_range(kj - kn, sn, n, on, lo, hi);
+        for (int i = 0; i < om; i++) {
+          int row = sm*i + ki - km;
+          if (row < 0 || row >= m) continue;
+          const real* s = src + i*on;
+          real* dst = x + (ci*m + row)*n + kj - kn;
+          for (int j = lo; j < hi; j++) {
+            dst[sn*j] += s[j];
+          }
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,26 @@
+// lowering of 2D multi-channel convolution to matrix multiply
+// inputs are stored channel by channel (c x m x n); the lowered matrix has
+// one row per (channel, kernel row, kernel column) and one column per output pixel
+// kernels are (2km+1) x (2kn+1) centered on the output pixel, and out of 
+// bounds inputs are treated as zero (padding)
+
+#ifndef _IM2COL
+#define _IM2COL
+
+#include <stdint.h>
+
+#include "real.h"
+
+// lower input x (c x m x n) into col ( [c*(2km+1)*(2kn+1)] x [om*on] )
+void im2col(const real* x, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, real* col);
+
+// lower quantized input, with out of bounds inputs set to pad (the zero point)
+void im2col(const uint8_t* x, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, uint8_t pad, uint8_t* col);
+
+// accumulate lowered matrix col back into x (c x m x n), adjoint of im2col
+void col2im(const real* col, int c, int m, int n, int km, int kn,
+    int sm, int sn, int om, int on, real* x);
+
+#endif
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cmath>
 #include <stdio.h>
+#include <algorithm>
 
 #ifdef USE_MPI
   #include "mpi.h"
@@ -9,6 +10,10 @@
 #endif
 
 #include "layer.h"
+#include "gemm.h"
+#include "im2col.h"
+#include "winograd.h"
+#include "vmath.h"
 #include "mpiutil.h"
 
 
@@ -30,13 +35,26 @@
 
 // constructor and destructor
 Layer::Layer(int inputs, int outputs) : 
-    inputs(inputs), outputs(outputs), pars(0), train(0) {};
+    inputs(inputs), outputs(outputs), pars(0), train(0), max_batch(1), valid(1), owns_param(1), owns_partial(1) {};
 Layer::~Layer() {}; 
 void Layer::print_params() {};
 void Layer::properties() {};
-void Layer::partial_param(double* in, double* delta) {};
+void Layer::partial_param(real* in, real* delta, int batch) {};
+
+// forward propagation, then activation in a pass over the outputs
+void Layer::forward_fused(real* in, real* out, int batch, int act) {
+  forward(in, out, batch);
+  vactivate(act, batch*outputs, out);
+}
+void Layer::param_changed() {};
 void Layer::add_layers(std::vector< std::vector <int> > config, double sigma) {};
 
+// set maximum batch size
+// layers with per-sample storage override this
+void Layer::set_batch(int max_batch) {
+  this->max_batch = max_batch;
+}
+
 // clear accumulated partial derivaties 
 void Layer::clear_partial() {
   for (int i = 0; i < pars; i++) {
@@ -45,19 +63,34 @@ void Layer::clear_partial() {
 }
 
 // update parameters using accumulated partial derivatives
+// with MPI, partials have already been summed over all ranks (see Net::allreduce_partial)
 void Layer::update_param(double lr, int batch_size) {
-#ifdef USE_MPI
-  double* update = new double[pars];
-  MPI_Allreduce(partial, update, pars, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-  for (int i = 0; i < pars; i++) {
-    param[i] -= (lr/batch_size)*update[i];
-  }
-  delete[] update;
-#else
   for (int i = 0; i < pars; i++) {
     param[i] -= (lr/batch_size)*partial[i];
   }
-#endif
+  param_changed();
+}
+
+// share parameters of another layer
+void Layer::share_param(Layer* L) {
+  if (owns_param) delete[] param;
+  param = L->param;
+  owns_param = 0;
+  param_changed();
+}
+
+// move parameters and partials into storage owned by the caller
+// (parameters are copied, partials start out cleared)
+void Layer::set_storage(real* param, real* partial) {
+  std::copy(this->param, this->param + pars, param);
+  std::fill(partial, partial + pars, 0);
+  if (owns_param) delete[] this->param;
+  if (owns_partial) delete[] this->partial;
+  this->param = param;
+  this->partial = partial;
+  owns_param = 0;
+  owns_partial = 0;
+  param_changed();
 }
 
 // syncs layer in all ranks to rank 0
@@ -66,7 +99,8 @@ void Layer::sync() {
   int numprocs, myid;
   whoami(numprocs, myid);
   if (pars > 0 && numprocs > 1) {
-    MPI_Bcast(param, pars, MPI_DOUBLE, 0, MPI_COMM_WORLD); 
+    MPI_Bcast(param, pars, MPI_REAL_T, 0, MPI_COMM_WORLD); 
+    param_changed();
   }
 }
 #endif
@@ -84,8 +118,8 @@ Linear::Linear(std::vector<int> config, double sigma)
   num_weights = inputs*outputs;
   pars = num_weights + outputs;
 
-  param   = new double[pars];
-  partial = new double[pars];
+  param   = new real[pars];
+  partial = new real[pars];
 
   // random device initialization
   std::random_device rd; 
@@ -101,13 +135,28 @@ Linear::Linear(std::vector<int> config, double sigma)
   for (int i = num_weights; i < pars; i++) {
     param[i] = 0;
   }
+
+#ifdef USE_BF16
+  weights_bf16 = new bf16[num_weights];
+  param_changed();
+#endif
 }
 
 // destructor
 Linear::~Linear() {
-  delete[] param;
-  delete[] partial;
+  if (owns_param) delete[] param;
+  if (owns_partial) delete[] partial;
+#ifdef USE_BF16
+  delete[] weights_bf16;
+#endif
+}
+
+#ifdef USE_BF16
+// round master weights to bf16
+void Linear::param_changed() {
+  float_to_bf16(num_weights, param, weights_bf16);
 }
+#endif
 
 // print weights and biases
 void Linear::print_params() {
@@ -138,56 +187,57 @@ void Linear::properties() {
 }
 
 // forward propagation
-void Linear::forward(double* in, double* out) {
-  // iterate over rows
-#pragma omp parallel for
-  for (int i = 0; i < outputs; i++) {
-    out[i] = bias(param,i);
-    // iterate over columns
-    for (int j = 0; j < inputs; j++) {
-      out[i] += weight(param,i,j) * in[j];
+// out = in * W^T + bias for the whole batch (in is [batch x inputs])
+void Linear::forward(real* in, real* out, int batch) {
+  forward_fused(in, out, batch, ACT_NONE);
+}
+
+// forward propagation, with activation applied as gemm stores the outputs
+void Linear::forward_fused(real* in, real* out, int batch, int act) {
+  // initialize outputs to biases
+  for (int b = 0; b < batch; b++) {
+    for (int i = 0; i < outputs; i++) {
+      out[ b*outputs + i ] = bias(param,i);
     }
   }
+#ifdef USE_BF16
+  gemm_bf16(GEMM_N, GEMM_T, batch, outputs, inputs, 
+      1.0, in, inputs, weights_bf16, inputs, 1.0, out, outputs, act);
+#else
+  gemm(GEMM_N, GEMM_T, batch, outputs, inputs, 
+      1.0, in, inputs, param, inputs, 1.0, out, outputs, act);
+#endif
 }
 
 // backward propagation
-void Linear::backward(double* in, double* out, double* delta) {
-  for (int i = 0; i < inputs; i++) {
-    delta[i] = 0;
-    for (int j = 0; j < outputs; j++ ) {
-      delta[i] += out[j] * weight(param,j,i);
-    }
-  }
+// delta = out * W for the whole batch; W is read along its rows
+void Linear::backward(real* in, real* out, real* delta, int batch) {
+#ifdef USE_BF16
+  gemm_bf16(GEMM_N, GEMM_N, batch, inputs, outputs, 
+      1.0, out, outputs, weights_bf16, inputs, 0.0, delta, inputs);
+#else
+  gemm(GEMM_N, GEMM_N, batch, inputs, outputs, 
+      1.0, out, outputs, param, inputs, 0.0, delta, inputs);
+#endif
 }
 
 // compute partial derivatives with respect to parameters
-void Linear::partial_param(double* in, double* delta) {
+void Linear::partial_param(real* in, real* delta, int batch) {
   // bias partials
-  for (int j = 0; j < outputs; j++) {
-    bias(partial,j) += delta[j];
-  }
-  // weight partials
-  for (int j = 0; j < outputs; j++) {
-    for (int k = 0; k < inputs; k++) {
-      weight(partial,j,k) += delta[j]*in[k];
+  for (int b = 0; b < batch; b++) {
+    for (int j = 0; j < outputs; j++) {
+      bias(partial,j) += delta[ b*outputs + j ];
     }
   }
+  // weight partials: accumulate delta^T * in
+  gemm(GEMM_T, GEMM_N, outputs, inputs, batch, 
+      1.0, delta, outputs, in, inputs, 1.0, partial, inputs);
 }
 
 //
 // sigmoid activation layer
 //
 
-// sigmoid activation function (single element)
-inline double sig(double x) {
-  return 1.0/(1.0 + exp(-x));
-}
-
-// derivative of sigmoid (single element)
-inline double d_sig(double x) {
-  return sig(x)*(1.0 - sig(x));
-}
-
 // constructor and destructor
 Sigmoid::Sigmoid(std::vector<int> config) : Layer(config[1], config[1]) {};
 Sigmoid::Sigmoid(int inputs) : Layer(inputs, inputs) {};
@@ -200,17 +250,16 @@ void Sigmoid::properties() {
 }
 
 // forward propagation
-void Sigmoid::forward(double* in, double* out) {
-  // iterate over inputs
-  for (int i = 0; i < inputs; i++) {
-    out[i] = sig(in[i]);
-  }
+void Sigmoid::forward(real* in, real* out, int batch) {
+  vsigmoid(batch*inputs, in, out);
 }
 
 // backward propagation
-void Sigmoid::backward(double* in, double* out, double* delta) {
-  for (int i = 0; i < inputs; i++) {
-    delta[i] = d_sig(in[i]) * out[i];
+// derivative of sigmoid s is s*(1-s), with s computed once into delta
+void Sigmoid::backward(real* in, real* out, real* delta, int batch) {
+  vsigmoid(batch*inputs, in, delta);
+  for (int i = 0; i < batch*inputs; i++) {
+    delta[i] = delta[i]*(1 - delta[i]) * out[i];
   }
 }
 
@@ -219,12 +268,12 @@ void Sigmoid::backward(double* in, double* out, double* delta) {
 //
 
 // rectified linear unit (single element)
-inline double rec(double x) {
-  return fmax(x, 0.0);
+inline real rec(real x) {
+  return (x > 0) ? x : 0;
 }
 
 // derivative of sigmoid (single element)
-inline double d_rec(double x) {
+inline real d_rec(real x) {
   return (x <= 0) ? 0.0 : 1.0;
 }
 
@@ -240,16 +289,16 @@ void ReLU::properties() {
 }
 
 // forward propagation
-void ReLU::forward(double* in, double* out) {
+void ReLU::forward(real* in, real* out, int batch) {
   // iterate over inputs
-  for (int i = 0; i < inputs; i++) {
+  for (int i = 0; i < batch*inputs; i++) {
     out[i] = rec(in[i]);
   }
 }
 
 // backward propagation
-void ReLU::backward(double* in, double* out, double* delta) {
-  for (int i = 0; i < inputs; i++) {
+void ReLU::backward(real* in, real* out, real* delta, int batch) {
+  for (int i = 0; i < batch*inputs; i++) {
     delta[i] = d_rec(in[i]) * out[i];
   }
 }
@@ -260,8 +309,9 @@ void ReLU::backward(double* in, double* out, double* delta) {
 //
 
 // constructor and destructor
-Softmax::Softmax(std::vector<int> config) : Layer(config[1], config[1]) {};
-Softmax::Softmax(int inputs) : Layer(inputs, inputs) {};
+Softmax::Softmax(std::vector<int> config) : 
+    Layer(config[1], config[1]), labels(NULL), loss(0), correct(0) {};
+Softmax::Softmax(int inputs) : Layer(inputs, inputs), labels(NULL), loss(0), correct(0) {};
 
 Softmax::~Softmax() {};
 
@@ -271,21 +321,54 @@ void Softmax::properties() {
 }
 
 // forward propagation
-void Softmax::forward(double* in, double* out) {
-  double normalizer = 0.0;
-  for (int i = 0; i < inputs; i++) {
-    out[i] = exp(in[i]);
-    normalizer += out[i];
+void Softmax::forward(real* in, real* out, int batch) {
+  if (train == 1 && labels != NULL) {
+    forward_loss(in, out, batch);
+    return;
   }
-  // divide each entry by normalizer
-  for (int i = 0; i < inputs; i++) {
-    out[i] /= normalizer;
+  // softmax is applied to each sample separately
+  for (int b = 0; b < batch; b++) {
+    softmax(inputs, in + b*inputs, out + b*outputs);
+  }
+}
+
+// forward propagation as output layer with cross-entropy loss
+void Softmax::forward_loss(real* in, real* out, int batch) {
+  loss = 0;
+  correct = 0;
+  for (int b = 0; b < batch; b++) {
+    real* x = in + b*inputs;
+    real* y = out + b*outputs;
+    unsigned int label = labels[b];
+    // largest input (the prediction)
+    int am = 0;
+    for (int i = 1; i < inputs; i++) {
+      if (x[i] > x[am]) am = i;
+    }
+    // y = exp(x - max)
+    for (int i = 0; i < inputs; i++) {
+      y[i] = x[i] - x[am];
+    }
+    vexp(inputs, y, y);
+    double normalizer = 0.0;
+    for (int i = 0; i < inputs; i++) {
+      normalizer += y[i];
+    }
+    // -log(probability of label) = log(normalizer) - (x[label] - max)
+    loss += std::log(normalizer) - (x[label] - x[am]);
+    correct += (am == (int) label);
+    // partials: probabilities minus one-hot label
+    const real scale = 1.0/normalizer;
+    for (int i = 0; i < inputs; i++) {
+      y[i] *= scale;
+    }
+    y[label] -= 1;
   }
 }
 
 // backward propagation
-void Softmax::backward(double* in, double* out, double* delta) {
-  for (int i = 0; i < inputs; i++) {
+void Softmax::backward(real* in, real* out, real* delta, int batch) {
+  for (int i = 0; i < batch*inputs; i++) {
     delta[i] = out[i];
   }
 }
@@ -319,35 +402,44 @@ void Dropout::set_dropout(double prob) {
   drop_prob = prob;
 }
 
+// set maximum batch size (one mask per sample)
+void Dropout::set_batch(int max_batch) {
+  if (max_batch != this->max_batch) {
+    delete[] mask;
+    mask = new int[max_batch*inputs];
+    this->max_batch = max_batch;
+  }
+}
+
 // print properties
 void Dropout::properties() {
   std::cout << "Dropout layer: dropout probability " << drop_prob << std::endl;
 }
 
 // forward propagation
-void Dropout::forward(double* in, double* out) {
+void Dropout::forward(real* in, real* out, int batch) {
   // pass through if not training
   if (train == 0) {
-    for (int i = 0; i < inputs; i++) {
+    for (int i = 0; i < batch*inputs; i++) {
       out[i] = in[i];
     }
   }
   // if we are training, the do dropout
   else {
-    // generate random mask, store in mask
-    for (int i = 0; i < outputs; i++) {
+    // generate random mask for all samples, store in mask
+    for (int i = 0; i < batch*outputs; i++) {
       mask[i] = ( d(gen) > drop_prob ) ? 1 : 0;
     }
     // apply mask
-    for (int i = 0; i < inputs; i++) {
+    for (int i = 0; i < batch*inputs; i++) {
       out[i] = in[i] * mask[i] / (1-drop_prob);
     }
   }
 }
 
 // backward propagation
-void Dropout::backward(double* in, double* out, double* delta) {
-  for (int i = 0; i < inputs; i++) {
+void Dropout::backward(real* in, real* out, real* delta, int batch) {
+  for (int i = 0; i < batch*inputs; i++) {
     delta[i] = out[i] * mask[i] / (1-drop_prob);
   }
 }
@@ -369,15 +461,36 @@ Maxpool::Maxpool(std::vector<int> config) :
   output_n = (int) ceil ( ((double)input_n) / ((double) stride_n) ); 
   outputs = channels * output_m * output_n;
 
+  // argmaxes are positions in window, which must fit in a byte
+  if (window_m > MAXPOOL_MAX_WINDOW || window_n > MAXPOOL_MAX_WINDOW) {
+    valid = ERROR_MAXPOOL_WINDOW;
+  }
+  window_offset = new int[ (2*window_m+1)*(2*window_n+1) ];
+  for (int wi = 0; wi < (2*window_m+1); wi++) {
+    for (int wj = 0; wj < (2*window_n+1); wj++) {
+      window_offset[ idx((2*window_n+1), wi, wj) ] = idx(input_n, (wi - window_m), (wj - window_n));
+    }
+  }
+
   // allocate argmax 
-  argmax = new int[outputs];
+  argmax = new uint8_t[outputs];
 }
 
 // destructor
 Maxpool::~Maxpool() {
   delete[] argmax;
+  delete[] window_offset;
 };
 
+// set maximum batch size (one set of argmaxes per sample)
+void Maxpool::set_batch(int max_batch) {
+  if (max_batch != this->max_batch) {
+    delete[] argmax;
+    argmax = new uint8_t[max_batch*outputs];
+    this->max_batch = max_batch;
+  }
+}
+
 // print properties
 void Maxpool::properties() {
   printf("Max pool layer: inputs %d (%d channels, %d x %d), outputs: %d (%d channels, %d x %d), window (%d x %d), stride (%d x %d)\n",
@@ -387,56 +500,130 @@ void Maxpool::properties() {
 };
 
 // forward propagation
-void Maxpool::forward(double* in, double* out) {
-  int row, col, center;
-  // do one channel at at time
-  for (int c = 0; c < channels; c++) {
-    // row of output
-    for (int i = 0; i < output_m; i++) {
-      // column of output
+// each output is the largest input in its window (the part of it in bounds),
+// starting from the center, then going through the window row by row, so
+// ties go to the center, or else to the first in the window
+// argmaxes are saved whether training or not
+void Maxpool::forward(real* in, real* out, int batch) {
+  if (valid != 1) return;
+  int specialized = (window_m == 1 && window_n == 1 && stride_m == 2 && stride_n == 2);
+  // do one sample at a time
+  for (int b = 0; b < batch; b++) {
+    // do one channel at at time
+    for (int c = 0; c < channels; c++) {
+      const real* x = in + b*inputs + c*input_m*input_n;
+      real* y = out + b*outputs + c*output_m*output_n;
+      uint8_t* am = argmax + b*outputs + c*output_m*output_n;
+      if (specialized) {
+        forward_3x3s2(x, y, am);
+      }
+      else {
+        forward_generic(x, y, am);
+      }
+    }
+  }
+}
+
+// output (i,j) of one channel, from the part of its window in bounds
+void Maxpool::pool_clipped(const real* x, real* y, uint8_t* am, int i, int j) {
+  int wn = 2*window_n+1;
+  // center of window, and rows and columns of window in bounds
+  int ci = stride_m*i;
+  int cj = stride_n*j;
+  int wi0 = std::max(0, window_m - ci);
+  int wi1 = std::min(2*window_m, input_m - 1 - ci + window_m);
+  int wj0 = std::max(0, window_n - cj);
+  int wj1 = std::min(2*window_n, input_n - 1 - cj + window_n);
+  const real* xc = x + idx(input_n, ci, cj);
+  real m = xc[0];
+  int a = idx(wn, window_m, window_n);
+  for (int wi = wi0; wi <= wi1; wi++) {
+    for (int wj = wj0; wj <= wj1; wj++) {
+      int k = idx(wn, wi, wj);
+      if (xc[ window_offset[k] ] > m) {
+        m = xc[ window_offset[k] ];
+        a = k;
+      }
+    }
+  }
+  y[ idx(output_n, i, j) ] = m;
+  am[ idx(output_n, i, j) ] = a;
+}
+
+// any window and stride
+void Maxpool::forward_generic(const real* x, real* y, uint8_t* am) {
+  for (int i = 0; i < output_m; i++) {
+    for (int j = 0; j < output_n; j++) {
+      pool_clipped(x, y, am, i, j);
+    }
+  }
+}
+
+// 3 x 3 window, stride 2
+// rows and columns of outputs whose window is not all in bounds (the first, 
+// and the last if the input size is even) are done by pool_clipped
+void Maxpool::forward_3x3s2(const real* x, real* y, uint8_t* am) {
+  // last output column with window in bounds
+  int last = (input_n - 2)/2;
+  for (int i = 0; i < output_m; i++) {
+    int r = 2*i;
+    if (r == 0 || r + 1 >= input_m) {
       for (int j = 0; j < output_n; j++) {
-        // initialize current max to center of window
-        center = idx3( input_m, input_n, c, stride_m*i, stride_n*j );
-        out[ idx3(output_m, output_n, c, i, j) ] = in[ center ];
-        // if training, save argmax
-        if (train == 1) {
-          argmax[ idx3(output_m, output_n, c, i, j) ] = center;
-        }
-        // row of window
-        for (int wi = 0; wi < (2*window_m+1); wi++ ) {
-          // column of window
-          for (int wj = 0; wj < (2*window_n+1); wj++) {
-            row = stride_m*i + wi - window_m;
-            col = stride_n*j + wj - window_n;
-            // only grab elements of input if we are in bounds
-            // this effectively pads with zeros
-            if (row >= 0 && row < input_m && col >= 0 && col < input_n) {
-              // update max if we are greater than current max
-              if ( in[ idx3(input_m, input_n, c, row, col) ] > out[ idx3(output_m, output_n, c, i, j) ] ) {
-                out[ idx3(output_m, output_n, c, i, j) ] = in[ idx3( input_m, input_n, c, row, col) ];
-                // if training, update argmax as well
-                if (train == 1) {
-                  // std::cout << idx3(input_m, input_n, c, row, col) << std::endl;
-                  argmax[ idx3(output_m, output_n, c, i, j) ] = idx3(input_m, input_n, c, row, col);
-                }
-              }
-            }
-          }
-        }
+        pool_clipped(x, y, am, i, j);
       }
+      continue;
+    }
+    // rows of window
+    const real* x0 = x + idx(input_n, (r-1), 0);
+    const real* x1 = x0 + input_n;
+    const real* x2 = x1 + input_n;
+    real* yi = y + idx(output_n, i, 0);
+    uint8_t* ai = am + idx(output_n, i, 0);
+    pool_clipped(x, y, am, i, 0);
+#pragma omp simd
+    for (int j = 1; j <= last; j++) {
+      int c = 2*j;
+      real m = x1[c];
+      int a = 4;
+      if (x0[c-1] > m) { m = x0[c-1]; a = 0; }
+      if (x0[c]   > m) { m = x0[c];   a = 1; }
+      if (x0[c+1] > m) { m = x0[c+1]; a = 2; }
+      if (x1[c-1] > m) { m = x1[c-1]; a = 3; }
+      if (x1[c+1] > m) { m = x1[c+1]; a = 5; }
+      if (x2[c-1] > m) { m = x2[c-1]; a = 6; }
+      if (x2[c]   > m) { m = x2[c];   a = 7; }
+      if (x2[c+1] > m) { m = x2[c+1]; a = 8; }
+      yi[j] = m;
+      ai[j] = a;
+    }
+    for (int j = std::max(last + 1, 1); j < output_n; j++) {
+      pool_clipped(x, y, am, i, j);
     }
   }
 }
 
 //  backward propagation
-void Maxpool::backward(double* in, double* out, double* delta) {
+void Maxpool::backward(real* in, real* out, real* delta, int batch) {
+  if (valid != 1) return;
   // initialize all delta to 0
-  for (int i = 0; i < inputs; i++) {
+  for (int i = 0; i < batch*inputs; i++) {
     delta[i] = 0;
   }
-  // add outputs to input corresponding to argmax
-  for (int i = 0; i < outputs; i++) {
-    delta[ argmax[i] ] += out[i];
+  // add outputs to input corresponding to argmax (stored per sample)
+  for (int b = 0; b < batch; b++) {
+    for (int c = 0; c < channels; c++) {
+      const real* dy = out + b*outputs + c*output_m*output_n;
+      const uint8_t* am = argmax + b*outputs + c*output_m*output_n;
+      for (int i = 0; i < output_m; i++) {
+        // centers of windows of output row i are in input row stride_m*i
+        real* dx = delta + b*inputs + c*input_m*input_n + stride_m*i*input_n;
+        for (int j = 0; j < output_n; j++) {
+          dx[ stride_n*j + window_offset[ am[j] ] ] += dy[j];
+        }
+        dy += output_n;
+        am += output_n;
+      }
+    }
   }
 }
 
@@ -451,7 +638,10 @@ Conv::Conv(std::vector<int> config, double sigma) :
       input_c(config[1]), input_m(config[2]), input_n(config[3]), 
       output_c(config[4]),
       ker_m(config[5]), ker_n(config[6]), 
-      stride_m(1), stride_n(1) {
+      stride_m(1), stride_n(1), 
+      algorithm(CONV_IM2COL), col(NULL), pad(NULL),
+      wino_filter(NULL), wino_dfilter(NULL), wino_in(NULL), wino_out(NULL),
+      wino_cap(0), wino_valid(0) {
 
   // output for each channel is ceil(input_m / sm) x ceil(input_n/sn)
   output_m = (int) ceil ( ((double)input_m) / ((double) stride_m) ); 
@@ -463,8 +653,8 @@ Conv::Conv(std::vector<int> config, double sigma) :
 
   // total parameters is weights + biases
   pars = num_weights + outputs;
-  param   = new double[pars];
-  partial = new double[pars];
+  param   = new real[pars];
+  partial = new real[pars];
 
   // random device initialization
   std::random_device rd; 
@@ -480,12 +670,61 @@ Conv::Conv(std::vector<int> config, double sigma) :
   for (int i = num_weights; i < pars; i++) {
     param[i] = 0; 
   }
+
+  // convolution algorithm, if specified
+  if (config.size() > 7) {
+    set_algorithm(config[7]);
+  }
+  else if (input_c >= WINOGRAD_MIN_CHANNELS) {
+    set_algorithm(CONV_WINOGRAD);
+  }
+  else if (ker_m == ker_n && (ker_m == 1 || ker_m == 2)) {
+    set_algorithm(CONV_DIRECT);
+  }
+  else {
+    set_algorithm(CONV_IM2COL);
+  }
 }
 
 // destructor
 Conv::~Conv() {
-  delete[] param;
-  delete[] partial;
+  if (owns_param) delete[] param;
+  if (owns_partial) delete[] partial;
+  delete[] col;
+  delete[] pad;
+  delete[] wino_filter;
+  delete[] wino_dfilter;
+  delete[] wino_in;
+  delete[] wino_out;
+}
+
+// set convolution algorithm, allocating workspace if needed
+void Conv::set_algorithm(int algorithm) {
+  // Winograd F(2x2,3x3) only covers 3x3 kernels with stride 1
+  if (algorithm == CONV_WINOGRAD && 
+      (ker_m != 1 || ker_n != 1 || stride_m != 1 || stride_n != 1)) {
+    algorithm = CONV_IM2COL;
+  }
+  this->algorithm = algorithm;
+  if (algorithm == CONV_IM2COL && col == NULL) {
+    col = new real[ (num_weights/output_c) * output_m*output_n ];
+  }
+  if (algorithm == CONV_DIRECT && pad == NULL &&
+      ker_m == ker_n && (ker_m == 1 || ker_m == 2)) {
+    int size = (input_m + 2*ker_m)*(input_n + 2*ker_n);
+    pad = new real[ std::max(input_c, output_c)*size + input_m*(input_n + 2*ker_n) ];
+    std::fill(pad, pad + std::max(input_c, output_c)*size, 0);
+  }
+  if (algorithm == CONV_WINOGRAD && wino_filter == NULL) {
+    wino_filter  = new real[ 16*output_c*input_c ];
+    wino_dfilter = new real[ 16*output_c*input_c ];
+    wino_valid = 0;
+  }
+}
+
+// kernel has changed, so transformed kernel must be recomputed
+void Conv::param_changed() {
+  wino_valid = 0;
 }
 
 // print properties
@@ -494,6 +733,8 @@ void Conv::properties() {
     inputs, input_c, input_m, input_n,
     outputs, output_c, output_m, output_n,
     2*ker_m+1, 2*ker_n+1, stride_m, stride_n);
+  printf("    algorithm: %s\n", (algorithm == CONV_WINOGRAD) ? "winograd" :
+    (algorithm == CONV_IM2COL) ? "im2col" : "direct");
 }
 
 void Conv::print_params() {
@@ -524,71 +765,149 @@ void Conv::print_params() {
 
 
 // forward propagation
-void Conv::forward(double* in, double* out) {
-  // initialize outputs to biases
-  for (int i = 0; i < outputs; i++) {
-    out[i] = bias(param, i);
+void Conv::forward(real* in, real* out, int batch) {
+  forward_fused(in, out, batch, ACT_NONE);
+}
+
+// forward propagation, with activation applied to the outputs of each 
+// sample (or with im2col, each tile) as they are stored
+void Conv::forward_fused(real* in, real* out, int batch, int act) {
+  if (algorithm == CONV_WINOGRAD) {
+    forward_winograd(in, out, batch, act);
+  }
+  else if (algorithm == CONV_IM2COL) {
+    forward_im2col(in, out, batch, act);
+  }
+  else if (ker_m == 1 && ker_n == 1) {
+    forward_fixed<1,1>(in, out, batch, act);
+  }
+  else if (ker_m == 2 && ker_n == 2) {
+    forward_fixed<2,2>(in, out, batch, act);
+  }
+  else {
+    forward_direct(in, out, batch, act);
+  }
+}
+
+// backward propagation
+void Conv::backward(real* in, real* out, real* delta, int batch) {
+  if (algorithm == CONV_WINOGRAD) {
+    backward_winograd(in, out, delta, batch);
+  }
+  else if (algorithm == CONV_IM2COL) {
+    backward_im2col(in, out, delta, batch);
+  }
+  else if (ker_m == 1 && ker_n == 1) {
+    backward_fixed<1,1>(in, out, delta, batch);
+  }
+  else if (ker_m == 2 && ker_n == 2) {
+    backward_fixed<2,2>(in, out, delta, batch);
+  }
+  else {
+    backward_direct(in, out, delta, batch);
+  }
+}
+
+// compute partial derivative of loss with respect to parmeters 
+void Conv::partial_param(real* in, real* delta, int batch) {
+  if (algorithm == CONV_WINOGRAD) {
+    partial_param_winograd(in, delta, batch);
+  }
+  else if (algorithm == CONV_IM2COL) {
+    partial_param_im2col(in, delta, batch);
+  }
+  else if (ker_m == 1 && ker_n == 1) {
+    partial_param_fixed<1,1>(in, delta, batch);
+  }
+  else if (ker_m == 2 && ker_n == 2) {
+    partial_param_fixed<2,2>(in, delta, batch);
+  }
+  else {
+    partial_param_direct(in, delta, batch);
   }
+}
+
+//
+// direct convolution
+//
+
+// forward propagation
+void Conv::forward_direct(real* in, real* out, int batch, int act) {
   int row, col;
-  // iterate over output channels
-  for (int co = 0; co < output_c; co++) {
-  // iterate over input channels
-    for (int ci = 0; ci < input_c; ci++) {
-      // row of output
-      for (int i = 0; i < output_m; i++) {
-        // column of output
-        for (int j = 0; j < output_n; j++) {
-          // row of kernel
-          for (int ki = 0; ki < (2*ker_m+1); ki++ ) {
-            // column of kernel
-            for (int kj = 0; kj < (2*ker_n+1); kj++) {
-              // index of row and column we need in input
-              row = stride_m*i + ki - ker_m;
-              col = stride_n*j + kj - ker_n;
-              // if we are in bounds, then multiply by appropriate kernel element
-              // to perform convolution; this effectively pads with zeros
-              if (row >= 0 && row < input_m && col >= 0 && col < input_n) {
-                out[ idx3(output_m, output_n, co, i, j) ] += 
-                  ker3(param,co,ci,ki,kj) *
-                  in[ idx3(input_m, input_n, ci, row, col) ];
+  // do one sample at a time
+  for (int b = 0; b < batch; b++) {
+    real* x = in + b*inputs;
+    real* y = out + b*outputs;
+    // initialize outputs to biases
+    for (int i = 0; i < outputs; i++) {
+      y[i] = bias(param, i);
+    }
+    // iterate over output channels
+    for (int co = 0; co < output_c; co++) {
+    // iterate over input channels
+      for (int ci = 0; ci < input_c; ci++) {
+        // row of output
+        for (int i = 0; i < output_m; i++) {
+          // column of output
+          for (int j = 0; j < output_n; j++) {
+            // row of kernel
+            for (int ki = 0; ki < (2*ker_m+1); ki++ ) {
+              // column of kernel
+              for (int kj = 0; kj < (2*ker_n+1); kj++) {
+                // index of row and column we need in input
+                row = stride_m*i + ki - ker_m;
+                col = stride_n*j + kj - ker_n;
+                // if we are in bounds, then multiply by appropriate kernel element
+                // to perform convolution; this effectively pads with zeros
+                if (row >= 0 && row < input_m && col >= 0 && col < input_n) {
+                  y[ idx3(output_m, output_n, co, i, j) ] += 
+                    ker3(param,co,ci,ki,kj) *
+                    x[ idx3(input_m, input_n, ci, row, col) ];
+                }
               }
             }
           }
         }
       }
     }
+    vactivate(act, outputs, y);
   }
 }
 
 // backward propagation
 // for now enforce stride 1
-void Conv::backward(double* in, double* out, double* delta) {
+void Conv::backward_direct(real* in, real* out, real* delta, int batch) {
   int row, col;
   // initialize deltas to 0
-  for (int i = 0; i < inputs; i++) {
+  for (int i = 0; i < batch*inputs; i++) {
     delta[i] = 0;
   }
-  // iterate over input channels
-  for (int ci = 0; ci < input_c; ci++) {
-    // iterate over output channels
-    for (int co = 0; co < output_c; co++) {
-      // row of input (delta is same size as input)
-      for (int i = 0; i < input_m; i++) {
-        // column of input (delta is same size as input)
-        for (int j = 0; j < input_n; j++) {
-          // row of kernel
-          for (int ki = 0; ki < (2*ker_m+1); ki++ ) {
-            // column of kernel
-            for (int kj = 0; kj < (2*ker_n+1); kj++) {
-              // index of row and column we need from output
-              row = i + ki - ker_m;
-              col = j + kj - ker_n;
-              // if we are in bounds, then multiply by appropriate kernel element
-              // for backpropagation we flip the kernel (horiz and vert)
-              if (row >= 0 && row < output_m && col >= 0 && col < output_n) {
-                delta[ idx3(input_m, input_n, ci, i, j) ] += 
-                  ker3(param,co,ci,(2*ker_m-ki), (2*ker_n-kj) ) *
-                  out[ idx3(output_m, output_n, co, row, col) ];
+  // do one sample at a time
+  for (int b = 0; b < batch; b++) {
+    real* dy = out + b*outputs;
+    real* dx = delta + b*inputs;
+    // iterate over input channels
+    for (int ci = 0; ci < input_c; ci++) {
+      // iterate over output channels
+      for (int co = 0; co < output_c; co++) {
+        // row of input (delta is same size as input)
+        for (int i = 0; i < input_m; i++) {
+          // column of input (delta is same size as input)
+          for (int j = 0; j < input_n; j++) {
+            // row of kernel
+            for (int ki = 0; ki < (2*ker_m+1); ki++ ) {
+              // column of kernel
+              for (int kj = 0; kj < (2*ker_n+1); kj++) {
+                // index of row and column we need from output
+                row = i + ki - ker_m;
+                col = j + kj - ker_n;
+                // if we are in bounds, then multiply by appropriate kernel element
+                // for backpropagation we flip the kernel (horiz and vert)
+                if (row >= 0 && row < output_m && col >= 0 && col < output_n) {
+                  dx[ idx3(input_m, input_n, ci, i, j) ] += 
+                    ker3(param,co,ci,(2*ker_m-ki), (2*ker_n-kj) ) *
+                    dy[ idx3(output_m, output_n, co, row, col) ];
+                }
               }
             }
           }
@@ -599,30 +918,35 @@ void Conv::backward(double* in, double* out, double* delta) {
 }
 
 // compute partial derivative of loss with respect to parmeters 
-void Conv::partial_param(double* in, double* delta) {
+void Conv::partial_param_direct(real* in, real* delta, int batch) {
   int row, col;
-  // bias partials
-  for (int i = 0; i < outputs; i++) {
-    bias(partial,i) += delta[i];
-  }
-  // iterate over outputs
-  for (int co = 0; co < output_c; co++) {
-  // iterate over inputs
-    for (int ci = 0; ci < input_c; ci++) {
-      // row of kernel
-      for (int ki = 0; ki < (2*ker_m+1); ki++ ) {
-        // column of kernel
-        for (int kj = 0; kj < (2*ker_n+1); kj++) {
-          // row of output
-          for (int i = 0; i < output_m; i++) {
-            // column of output
-            for (int j = 0; j < output_n; j++) {
-              row = stride_m*i + ki - ker_m;
-              col = stride_n*j + kj - ker_n;
-              if (row >= 0 && row < input_m && col >= 0 && col < input_n) {
-                ker3(partial,co,ci,ki,kj) += 
-                  delta[ idx3(output_m, output_n, co, i, j) ] *
-                  in[ idx3(output_m, input_n, ci, row, col) ];
+  // do one sample at a time
+  for (int b = 0; b < batch; b++) {
+    real* x = in + b*inputs;
+    real* d = delta + b*outputs;
+    // bias partials
+    for (int i = 0; i < outputs; i++) {
+      bias(partial,i) += d[i];
+    }
+    // iterate over outputs
+    for (int co = 0; co < output_c; co++) {
+    // iterate over inputs
+      for (int ci = 0; ci < input_c; ci++) {
+        // row of kernel
+        for (int ki = 0; ki < (2*ker_m+1); ki++ ) {
+          // column of kernel
+          for (int kj = 0; kj < (2*ker_n+1); kj++) {
+            // row of output
+            for (int i = 0; i < output_m; i++) {
+              // column of output
+              for (int j = 0; j < output_n; j++) {
+                row = stride_m*i + ki - ker_m;
+                col = stride_n*j + kj - ker_n;
+                if (row >= 0 && row < input_m && col >= 0 && col < input_n) {
+                  ker3(partial,co,ci,ki,kj) += 
+                    d[ idx3(output_m, output_n, co, i, j) ] *
+                    x[ idx3(input_m, input_n, ci, row, col) ];
+                }
               }
             }
           }
@@ -632,5 +956,313 @@ void Conv::partial_param(double* in, double* delta) {
   }
 }
 
+//
+// direct convolution with kernel size fixed at compile time
+// planes are copied into zero padded planes ((m+2km) x (n+2kn)) in pad, so
+// every window is inside a plane, and outputs are accumulated in pad with
+// the same row stride, so each plane is a single loop with the kernel loops
+// fully unrolled and the kernel in registers; stride is 1, so every plane
+// has the same size
+//
 
+// copy c planes of m x n into the interiors of the padded planes
+// (borders are zeroed when pad is allocated, and never written)
+static void pad_planes(const real* x, real* xp, int c, int m, int n, int km, int kn) {
+  int W = n + 2*kn;
+  int H = m + 2*km;
+  for (int ch = 0; ch < c; ch++) {
+    for (int i = 0; i < m; i++) {
+      std::copy(x + n*(m*ch + i), x + n*(m*ch + i + 1), xp + H*W*ch + W*(km + i) + kn);
+    }
+  }
+}
+
+// y[p] += sum over kernel w of w(ki,kj) * x[p + W*ki + kj], for p < len
+template <int KM, int KN>
+static void conv_plane(const real* w, const real* x, real* y, int len, int W) {
+  const int KH = 2*KM+1, KW = 2*KN+1;
+  real k[KH*KW];
+#pragma GCC unroll 32
+  for (int t = 0; t < KH*KW; t++) {
+    k[t] = w[t];
+  }
+#pragma omp simd
+  for (int p = 0; p < len; p++) {
+    real s = 0;
+#pragma GCC unroll 8
+    for (int ki = 0; ki < KH; ki++) {
+#pragma GCC unroll 8
+      for (int kj = 0; kj < KW; kj++) {
+        s += k[KW*ki + kj] * x[p + W*ki + kj];
+      }
+    }
+    y[p] += s;
+  }
+}
 
+// dw(ki,kj) += sum over p < len of d[p] * x[p + W*ki + kj]
+// each kernel element has its own V partial sums, so one pass over d suffices
+template <int KM, int KN>
+static void conv_plane_partial(const real* d, const real* x, real* dw, int len, int W) {
+  const int KH = 2*KM+1, KW = 2*KN+1;
+  const int V = 64/sizeof(real);
+  real s[KH*KW][V];
+  for (int t = 0; t < KH*KW; t++) {
+    for (int v = 0; v < V; v++) {
+      s[t][v] = 0;
+    }
+  }
+  int p = 0;
+  for (; p + V <= len; p += V) {
+#pragma GCC unroll 8
+    for (int ki = 0; ki < KH; ki++) {
+#pragma GCC unroll 8
+      for (int kj = 0; kj < KW; kj++) {
+        const real* xk = x + p + W*ki + kj;
+#pragma omp simd
+        for (int v = 0; v < V; v++) {
+          s[KW*ki + kj][v] += d[p + v] * xk[v];
+        }
+      }
+    }
+  }
+  for (int ki = 0; ki < KH; ki++) {
+    for (int kj = 0; kj < KW; kj++) {
+      real sum = 0;
+      for (int v = 0; v < V; v++) {
+        sum += s[KW*ki + kj][v];
+      }
+      for (int q = p; q < len; q++) {
+        sum += d[q] * x[q + W*ki + kj];
+      }
+      dw[KW*ki + kj] += sum;
+    }
+  }
+}
+
+// forward propagation
+template <int KM, int KN>
+void Conv::forward_fixed(real* in, real* out, int batch, int act) {
+  int W = input_n + 2*KN;
+  int H = input_m + 2*KM;
+  int P = input_m*input_n;
+  // output rows with stride W (the last row without its padding)
+  int len = input_m*W - 2*KN;
+  real* acc = pad + std::max(input_c, output_c)*H*W;
+  for (int b = 0; b < batch; b++) {
+    real* y = out + b*outputs;
+    pad_planes(in + b*inputs, pad, input_c, input_m, input_n, KM, KN);
+    for (int co = 0; co < output_c; co++) {
+      std::fill(acc, acc + len, 0);
+      for (int ci = 0; ci < input_c; ci++) {
+        conv_plane<KM,KN>(&ker3(param,co,ci,0,0), pad + H*W*ci, acc, len, W);
+      }
+      for (int i = 0; i < input_m; i++) {
+        for (int j = 0; j < input_n; j++) {
+          y[P*co + input_n*i + j] = bias(param, P*co + input_n*i + j) + acc[W*i + j];
+        }
+      }
+      vactivate(act, P, y + P*co);
+    }
+  }
+}
+
+// backward propagation: delta is out correlated with the flipped kernel
+template <int KM, int KN>
+void Conv::backward_fixed(real* in, real* out, real* delta, int batch) {
+  const int K = (2*KM+1)*(2*KN+1);
+  int W = input_n + 2*KN;
+  int H = input_m + 2*KM;
+  int P = input_m*input_n;
+  int len = input_m*W - 2*KN;
+  real* acc = pad + std::max(input_c, output_c)*H*W;
+  real flip[K];
+  for (int b = 0; b < batch; b++) {
+    real* dx = delta + b*inputs;
+    pad_planes(out + b*outputs, pad, output_c, output_m, output_n, KM, KN);
+    for (int ci = 0; ci < input_c; ci++) {
+      std::fill(acc, acc + len, 0);
+      for (int co = 0; co < output_c; co++) {
+        const real* w = &ker3(param,co,ci,0,0);
+        for (int t = 0; t < K; t++) {
+          flip[t] = w[K-1-t];
+        }
+        conv_plane<KM,KN>(flip, pad + H*W*co, acc, len, W);
+      }
+      for (int i = 0; i < input_m; i++) {
+        for (int j = 0; j < input_n; j++) {
+          dx[P*ci + input_n*i + j] = acc[W*i + j];
+        }
+      }
+    }
+  }
+}
+
+// compute partial derivative of loss with respect to parmeters 
+template <int KM, int KN>
+void Conv::partial_param_fixed(real* in, real* delta, int batch) {
+  int W = input_n + 2*KN;
+  int H = input_m + 2*KM;
+  int P = input_m*input_n;
+  int len = input_m*W - 2*KN;
+  real* acc = pad + std::max(input_c, output_c)*H*W;
+  for (int b = 0; b < batch; b++) {
+    real* d = delta + b*outputs;
+    // bias partials
+    for (int i = 0; i < outputs; i++) {
+      bias(partial,i) += d[i];
+    }
+    pad_planes(in + b*inputs, pad, input_c, input_m, input_n, KM, KN);
+    for (int co = 0; co < output_c; co++) {
+      // delta of channel co with row stride W, zero between rows
+      std::fill(acc, acc + len, 0);
+      for (int i = 0; i < output_m; i++) {
+        std::copy(d + P*co + output_n*i, d + P*co + output_n*(i+1), acc + W*i);
+      }
+      for (int ci = 0; ci < input_c; ci++) {
+        conv_plane_partial<KM,KN>(acc, pad + H*W*ci, &ker3(partial,co,ci,0,0), len, W);
+      }
+    }
+  }
+}
+
+//
+// im2col convolution
+// kernel is stored as a (output_c x K) matrix, K = input_c*(2km+1)*(2kn+1), 
+// with the same ordering as the rows of the lowered input
+//
+
+// forward propagation: out = kernel * col + bias
+void Conv::forward_im2col(real* in, real* out, int batch, int act) {
+  int K = num_weights/output_c;
+  int P = output_m*output_n;
+  for (int b = 0; b < batch; b++) {
+    real* y = out + b*outputs;
+    for (int i = 0; i < outputs; i++) {
+      y[i] = bias(param, i);
+    }
+    im2col(in + b*inputs, input_c, input_m, input_n, ker_m, ker_n,
+        stride_m, stride_n, output_m, output_n, col);
+    gemm(GEMM_N, GEMM_N, output_c, P, K, 1.0, param, K, col, P, 1.0, y, P, act);
+  }
+}
+
+// backward propagation: col = kernel^T * out, then fold col back onto delta
+void Conv::backward_im2col(real* in, real* out, real* delta, int batch) {
+  int K = num_weights/output_c;
+  int P = output_m*output_n;
+  for (int i = 0; i < batch*inputs; i++) {
+    delta[i] = 0;
+  }
+  for (int b = 0; b < batch; b++) {
+    gemm(GEMM_T, GEMM_N, K, P, output_c, 1.0, param, K, out + b*outputs, P, 0.0, col, P);
+    col2im(col, input_c, input_m, input_n, ker_m, ker_n,
+        stride_m, stride_n, output_m, output_n, delta + b*inputs);
+  }
+}
+
+// compute partial derivative of loss with respect to parameters:
+// kernel partials += delta * col^T (col is recomputed from input)
+void Conv::partial_param_im2col(real* in, real* delta, int batch) {
+  int K = num_weights/output_c;
+  int P = output_m*output_n;
+  for (int b = 0; b < batch; b++) {
+    real* d = delta + b*outputs;
+    // bias partials
+    for (int i = 0; i < outputs; i++) {
+      bias(partial,i) += d[i];
+    }
+    im2col(in + b*inputs, input_c, input_m, input_n, ker_m, ker_n,
+        stride_m, stride_n, output_m, output_n, col);
+    gemm(GEMM_N, GEMM_T, output_c, K, P, 1.0, d, P, col, P, 1.0, partial, K);
+  }
+}
+
+//
+// Winograd F(2x2,3x3) convolution
+// samples are done one at a time so the transformed tiles stay in cache;
+// summing over channels is then one gemm per point of the 4x4 transformed tile
+//
+
+// grow workspace for transformed inputs and outputs
+void Conv::winograd_reserve(int tiles) {
+  if (tiles > wino_cap) {
+    delete[] wino_in;
+    delete[] wino_out;
+    wino_in  = new real[ 16*input_c*tiles ];
+    wino_out = new real[ 16*output_c*tiles ];
+    wino_cap = tiles;
+  }
+}
+
+// forward propagation
+void Conv::forward_winograd(real* in, real* out, int batch, int act) {
+  int T = winograd_tiles(output_m, output_n);
+  winograd_reserve(T);
+  // transform kernel only when it has changed
+  if (wino_valid == 0) {
+    winograd_filter(param, output_c, input_c, wino_filter);
+    wino_valid = 1;
+  }
+  for (int b = 0; b < batch; b++) {
+    real* y = out + b*outputs;
+    winograd_input(in + b*inputs, input_c, input_m, input_n, wino_in, T, 0);
+    for (int xi = 0; xi < 16; xi++) {
+      gemm(GEMM_N, GEMM_N, output_c, T, input_c, 
+          1.0, wino_filter + xi*output_c*input_c, input_c, wino_in + xi*input_c*T, T, 
+          0.0, wino_out + xi*output_c*T, T);
+    }
+    for (int i = 0; i < outputs; i++) {
+      y[i] = bias(param, i);
+    }
+    winograd_output(wino_out, output_c, output_m, output_n, T, 0, y);
+    vactivate(act, outputs, y);
+  }
+}
+
+// backward propagation: transposes of the forward transforms, in reverse order
+void Conv::backward_winograd(real* in, real* out, real* delta, int batch) {
+  int T = winograd_tiles(output_m, output_n);
+  winograd_reserve(T);
+  if (wino_valid == 0) {
+    winograd_filter(param, output_c, input_c, wino_filter);
+    wino_valid = 1;
+  }
+  for (int i = 0; i < batch*inputs; i++) {
+    delta[i] = 0;
+  }
+  for (int b = 0; b < batch; b++) {
+    winograd_output_adjoint(out + b*outputs, output_c, output_m, output_n, wino_out, T, 0);
+    for (int xi = 0; xi < 16; xi++) {
+      gemm(GEMM_T, GEMM_N, input_c, T, output_c, 
+          1.0, wino_filter + xi*output_c*input_c, input_c, wino_out + xi*output_c*T, T, 
+          0.0, wino_in + xi*input_c*T, T);
+    }
+    winograd_input_adjoint(wino_in, input_c, input_m, input_n, T, 0, delta + b*inputs);
+  }
+}
+
+// compute partial derivative of loss with respect to parameters
+// partials of transformed kernel are summed over tiles of all samples, 
+// then transformed back once
+void Conv::partial_param_winograd(real* in, real* delta, int batch) {
+  int T = winograd_tiles(output_m, output_n);
+  winograd_reserve(T);
+  for (int b = 0; b < batch; b++) {
+    real* d = delta + b*outputs;
+    // bias partials
+    for (int i = 0; i < outputs; i++) {
+      bias(partial,i) += d[i];
+    }
+    winograd_input(in + b*inputs, input_c, input_m, input_n, wino_in, T, 0);
+    winograd_output_adjoint(d, output_c, output_m, output_n, wino_out, T, 0);
+    for (int xi = 0; xi < 16; xi++) {
+      gemm(GEMM_N, GEMM_T, output_c, input_c, T, 
+          1.0, wino_out + xi*output_c*T, T, wino_in + xi*input_c*T, T, 
+          (b == 0) ? 0.0 : 1.0, wino_dfilter + xi*output_c*input_c, input_c);
+    }
+  }
+  if (batch > 0) {
+    winograd_filter_adjoint(wino_dfilter, output_c, input_c, partial);
+  }
+}
@@ -1,5 +1,11 @@
 #include <random>
 #include <vector>
+#include <stdint.h>
+
+#include "real.h"
+#ifdef USE_BF16
+  #include "bf16.h"
+#endif
 
 #ifndef _LAYER
 #define _LAYER
@@ -10,6 +16,19 @@
 #define CONV 103
 #define MAXPOOL 104
 
+// convolution algorithms
+#define CONV_DIRECT 301
+#define CONV_IM2COL 302
+#define CONV_WINOGRAD 303
+
+// largest Maxpool window half-width (window up to 15 x 15, so an argmax fits 
+// in a byte); layers with larger windows are invalid
+#define MAXPOOL_MAX_WINDOW 7
+
+// fewest input channels for which 3x3 Conv layers use Winograd by default;
+// below this the tile transforms cost more than the multiplies they save
+#define WINOGRAD_MIN_CHANNELS 8
+
 // activations
 #define SIG 201
 #define RELU 202
@@ -17,6 +36,7 @@
 
 // errors
 #define ERROR_SIZE_MISMATCH -1
+#define ERROR_MAXPOOL_WINDOW -3
 
 //
 // abstract layer class
@@ -32,25 +52,45 @@ class Layer {
     // are we training or not?
     int train;
 
+    // maximum number of samples in a batch
+    int max_batch;
+
+    // is layer valid? (1, or an error for a configuration it does not support)
+    int valid;
+
     // parameters and partial derivatives with respect to parameters
-    double* param;
-    double* partial;
+    real* param;
+    real* partial;
+    // does layer own param? (not if it shares the parameters of another layer,
+    // or they are a view into the arena of a Net) and partial?
+    int owns_param;
+    int owns_partial;
 
     // constructor and destructor
     Layer(int inputs, int outputs);
     virtual ~Layer(); 
     virtual void add_layers(std::vector< std::vector <int> > config, double sigma);
 
+    // set maximum batch size (allocates any per-sample storage)
+    virtual void set_batch(int max_batch);
+
     // print parameters and properties
     virtual void print_params();
     virtual void properties();
 
-    // forward and backward propagation
-    virtual void forward(double* in, double* out) = 0;
-    virtual void backward(double* in, double* out, double* delta) = 0;
+    // forward and backward propagation on a batch of samples
+    // in is [batch x inputs], out and delta are [batch x outputs] and [batch x inputs]
+    virtual void forward(real* in, real* out, int batch) = 0;
+    virtual void backward(real* in, real* out, real* delta, int batch) = 0;
+
+    // forward propagation followed by activation act (ACT_NONE, ACT_RELU or 
+    // ACT_SIGMOID) of the outputs; layers that store their outputs in blocks
+    // apply it to each block as it is stored, others in a pass after forward
+    virtual void forward_fused(real* in, real* out, int batch, int act);
 
     // compute partial derivative of loss with respect to parmeters 
-    virtual void partial_param(double* in, double* delta);
+    // (summed over all samples in batch)
+    virtual void partial_param(real* in, real* delta, int batch);
 
     // clear accumulated partial derivaties 
     virtual void clear_partial();
@@ -58,6 +98,16 @@ class Layer {
     // update parameters using accumulated partial derivatives
     virtual void update_param(double lr, int batch_size);
 
+    // notify layer that param has been modified (invalidates anything derived from it)
+    virtual void param_changed();
+
+    // use the parameters of layer L (same type and size) in place of own;
+    // partials stay private to each layer
+    void share_param(Layer* L);
+
+    // move parameters and partials into storage owned by the caller
+    void set_storage(real* param, real* partial);
+
 #ifdef USE_MPI
     // syncs layer in all ranks to rank 0
     void sync();
@@ -73,6 +123,12 @@ class Linear : public Layer {
     // number of weights
     int num_weights;
 
+#ifdef USE_BF16
+    // bf16 copy of weights used by forward and backward; param holds the 
+    // float master copy that update_param and sync work on
+    bf16* weights_bf16;
+#endif
+
     // constructor and destructor
     Linear(std::vector<int> config, double sigma);
     ~Linear();
@@ -82,11 +138,17 @@ class Linear : public Layer {
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void forward_fused(real* in, real* out, int batch, int act);
+    void backward(real* in, real* out, real* delta, int batch);
 
     // update partial derivative of loss with respect to parmeters 
-    void partial_param(double* in, double* delta);
+    void partial_param(real* in, real* delta, int batch);
+
+#ifdef USE_BF16
+    // refresh bf16 weights from master copy
+    void param_changed();
+#endif
 };
 
 //
@@ -104,8 +166,8 @@ class Sigmoid : public Layer {
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void backward(real* in, real* out, real* delta, int batch);
 };
 
 //
@@ -123,8 +185,8 @@ class ReLU : public Layer {
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void backward(real* in, real* out, real* delta, int batch);
 };
 
 //
@@ -133,6 +195,18 @@ class ReLU : public Layer {
 
 class Softmax : public Layer {
   public:
+    // backward treats softmax as the output layer with cross-entropy loss, and
+    // passes on the partials of the loss with respect to its outputs as those
+    // with respect to its inputs (probabilities minus one-hot labels)
+    // with labels set (one per sample), forward in training is that output
+    // layer: in one pass over the inputs of each sample, it computes the loss,
+    // whether the largest input is the label, and those partials, which it 
+    // writes to out in place of the probabilities
+    unsigned int* labels;
+    // loss summed over the samples of the last such forward, and number correct
+    double loss;
+    int correct;
+
      // constructor and destructor : same number of inputs and outputs
     Softmax(std::vector<int> config);
     Softmax(int inputs);
@@ -142,8 +216,12 @@ class Softmax : public Layer {
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void backward(real* in, real* out, real* delta, int batch);
+
+  private:
+    // forward propagation as output layer with cross-entropy loss
+    void forward_loss(real* in, real* out, int batch);
 };
 
 
@@ -167,12 +245,15 @@ class Dropout : public Layer {
     // set dropout probability (default from constructor is 0.25)
     void set_dropout(double prob);
 
+    // set maximum batch size (reallocates mask)
+    void set_batch(int max_batch);
+
     // print properties
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void backward(real* in, real* out, real* delta, int batch);
 
   private:
     // uniform[0,1] random number generator
@@ -198,19 +279,36 @@ class Maxpool : public Layer {
     // output dimensions (om x om)
     int output_m, output_n;
 
-    // stored argmaxes for outputs
-    int* argmax;
+    // stored argmaxes for outputs, as positions in window (row-major)
+    uint8_t* argmax;
+    // offset of input at each position in window from the center of window
+    int* window_offset;
 
     // constructor and destructor
+    // 3 x 3 windows with stride 2 have a kernel of their own; windows larger
+    // than MAXPOOL_MAX_WINDOW make the layer invalid (ERROR_MAXPOOL_WINDOW),
+    // and it then propagates nothing
     Maxpool(std::vector<int> config);
     ~Maxpool();
 
+    // set maximum batch size (reallocates argmax)
+    void set_batch(int max_batch);
+
     // print properties
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void backward(real* in, real* out, real* delta, int batch);
+
+  private:
+    // output (c,i,j) of one channel of one sample, the part of its window 
+    // in bounds only
+    void pool_clipped(const real* x, real* y, uint8_t* am, int i, int j);
+    // any window and stride
+    void forward_generic(const real* x, real* y, uint8_t* am);
+    // 3 x 3 window, stride 2 (interior vectorized across columns)
+    void forward_3x3s2(const real* x, real* y, uint8_t* am);
 };
 
 
@@ -231,20 +329,74 @@ class Conv : public Layer {
     // number of weights (kernel components)
     int num_weights;
 
+    // convolution algorithm (CONV_DIRECT, CONV_IM2COL or CONV_WINOGRAD)
+    int algorithm;
+    // workspace for im2col: lowered input ( input_c*(2km+1)*(2kn+1) x output_m*output_n )
+    real* col;
+    // workspace for direct convolution of 3x3 and 5x5 kernels: zero padded planes
+    // (max(input_c, output_c) x (m+2km) x (n+2kn)) and one output plane with their row stride
+    real* pad;
+
+    // workspace for Winograd: transformed kernel and its partials (16 x output_c x input_c),
+    // transformed inputs (16 x input_c x tiles) and outputs (16 x output_c x tiles)
+    real* wino_filter;
+    real* wino_dfilter;
+    real* wino_in;
+    real* wino_out;
+    // number of tiles the Winograd workspace can hold
+    int wino_cap;
+    // is transformed kernel up to date with param?
+    int wino_valid;
+
     // constructor and destructor
+    // optional config[7] selects algorithm; by default 3x3 kernels with at least
+    // WINOGRAD_MIN_CHANNELS input channels use CONV_WINOGRAD, 3x3 and 5x5 kernels
+    // with fewer use CONV_DIRECT, and all others CONV_IM2COL
     Conv(std::vector<int> config, double sigma);
     ~Conv();
 
+    // set convolution algorithm
+    // CONV_WINOGRAD falls back to CONV_IM2COL for kernels other than 3x3
+    void set_algorithm(int algorithm);
+
+    // invalidate transformed kernel
+    void param_changed();
+
     // print parameters and properties
     void print_params();
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void forward_fused(real* in, real* out, int batch, int act);
+    void backward(real* in, real* out, real* delta, int batch);
 
     // update partial derivative of loss with respect to parmeters 
-    void partial_param(double* in, double* delta);
+    void partial_param(real* in, real* delta, int batch);
+
+  private:
+    // direct (nested loop) implementation
+    void forward_direct(real* in, real* out, int batch, int act);
+    void backward_direct(real* in, real* out, real* delta, int batch);
+    void partial_param_direct(real* in, real* delta, int batch);
+
+    // direct implementation with kernel (2KM+1 x 2KN+1) fixed at compile time,
+    // used instead of the above for 3x3 and 5x5 kernels
+    template <int KM, int KN> void forward_fixed(real* in, real* out, int batch, int act);
+    template <int KM, int KN> void backward_fixed(real* in, real* out, real* delta, int batch);
+    template <int KM, int KN> void partial_param_fixed(real* in, real* delta, int batch);
+
+    // im2col + gemm implementation
+    void forward_im2col(real* in, real* out, int batch, int act);
+    void backward_im2col(real* in, real* out, real* delta, int batch);
+    void partial_param_im2col(real* in, real* delta, int batch);
+
+    // Winograd F(2x2,3x3) implementation
+    void forward_winograd(real* in, real* out, int batch, int act);
+    void backward_winograd(real* in, real* out, real* delta, int batch);
+    void partial_param_winograd(real* in, real* delta, int batch);
+    // make sure workspace holds given number of tiles
+    void winograd_reserve(int tiles);
 };
 
 #endif
\ No newline at end of file
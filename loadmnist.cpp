@@ -2,9 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "loadmnist.h"
 
+/* Size of headers of image and label files. */
+#define IMAGE_HEADER 16
+#define LABEL_HEADER 8
+
 /*
  * Load a unsigned int from raw data.
  * MSB first.
@@ -32,8 +39,11 @@ static unsigned int mnist_bin_to_int(char *v)
 unsigned int mnist_load(
 	const char* image_filename,
 	const char* label_filename,
-	double** &data,
-	unsigned int* &labels)
+	uint8_t* &images,
+	unsigned int* &labels,
+	int &map,
+	int shard,
+	int num_shards)
 {
 	int return_code = 0;
 	int i;
@@ -94,32 +104,65 @@ unsigned int mnist_load(
 		return return_code;
 	}
 
-	// allocate memory for data and labels
-	data = new double*[image_cnt];
-	labels = new unsigned int[image_cnt];
-	for (i = 0; i < image_cnt; i++) {
-		data[i] = new double[IMAGESIZE];
+	// samples of shard: an equal part of them, the last shard also takes the rest
+	unsigned int first = (image_cnt/num_shards)*shard;
+	unsigned int last = (shard == num_shards-1) ? image_cnt : (image_cnt/num_shards)*(shard+1);
+	unsigned int cnt = last - first;
+
+	// map images (from the page holding the first one), or allocate and read them
+	size_t image_bytes = (size_t) cnt*IMAGESIZE;
+	size_t offset = IMAGE_HEADER + (size_t) first*IMAGESIZE;
+	struct stat st;
+	if (fstat(fileno(ifp), &st) != 0 || (size_t) st.st_size < offset + image_bytes) {
+		map = 0; /* cannot map a truncated file */
 	}
-
-	// read data
-	for (i = 0; i < image_cnt; i++) {
-		unsigned char read_data[IMAGESIZE];
-
-		// read and store data
-		ret = fread(read_data, 1, IMAGESIZE, ifp);
-		for (int j = 0; j < IMAGESIZE; j++) {
-			data[i][j] = read_data[j] / 255.0;
+	if (map) {
+		size_t page = offset - offset % sysconf(_SC_PAGESIZE);
+		void* p = mmap(NULL, offset - page + image_bytes, PROT_READ, MAP_PRIVATE, fileno(ifp), page);
+		if (p == MAP_FAILED) {
+			map = 0;
+		}
+		else {
+			images = (uint8_t*) p + (offset - page);
 		}
-		// read and store label
-		ret = fread(tmp, 1, 1, lfp);
-		labels[i] = tmp[0];
 	}
+	if (!map) {
+		images = new uint8_t[image_bytes];
+		fseek(ifp, offset, SEEK_SET);
+		ret = fread(images, 1, image_bytes, ifp);
+	}
+
+	// read labels
+	labels = new unsigned int[cnt];
+	unsigned char* read_labels = new unsigned char[cnt];
+	fseek(lfp, LABEL_HEADER + first, SEEK_SET);
+	ret = fread(read_labels, 1, cnt, lfp);
+	for (i = 0; i < cnt; i++) {
+		labels[i] = read_labels[i];
+	}
+	delete[] read_labels;
 
 	// close files
 	if (ifp) fclose(ifp);
 	if (lfp) fclose(lfp);
 
 	// return number of images loaded
-	return image_cnt;
+	return cnt;
 }
 
+/*
+ * Free images and labels.
+ */
+
+void mnist_free(uint8_t* images, unsigned int* labels, unsigned int cnt, int map)
+{
+	if (map) {
+		// mapping starts at the page holding the first image
+		size_t skip = (uintptr_t) images % sysconf(_SC_PAGESIZE);
+		munmap(images - skip, skip + (size_t) cnt*IMAGESIZE);
+	}
+	else {
+		delete[] images;
+	}
+	delete[] labels;
+}
@@ -1,19 +1,33 @@
 // MNIST data loader 
 // original version by Nuri Park - https://github.com/projectgalateia/mnist
 // modified to use c++ new for allocation and to return images as a single array
-// loads data as double
+// loads images as bytes, stored one after another in one block (IMAGESIZE 
+// bytes per image), which is either read into memory or mapped from the file
 
 #ifndef _LOADMNIST
 #define _LOADMNIST
 
+#include <stdint.h>
+
 // MNIST image size
 #define IMAGESIZE 784
 
 // data loader
+// map: map the image file instead of reading it (if possible); set to whether
+// it was mapped, to be passed on to mnist_free
+// shard, num_shards: only load shard of num_shards equal parts of the samples
+// (the last one also takes the rest), seeking to it in the files
+// returns number of samples loaded
 unsigned int mnist_load(
 	const char* image_filename,
 	const char* label_filename,
-	double** &data,
-	unsigned int* &labels);
+	uint8_t* &images,
+	unsigned int* &labels,
+	int &map,
+	int shard = 0,
+	int num_shards = 1);
+
+// free images and labels loaded by mnist_load
+void mnist_free(uint8_t* images, unsigned int* labels, unsigned int cnt, int map);
 
 #endif
\ No newline at end of file
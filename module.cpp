@@ -1,4 +1,5 @@
 #include "module.h"
+#include "net.h"
 #include <iostream>
 #include <stdio.h>
 
@@ -8,10 +9,17 @@
 
 // constructor and destructor
 Module::Module(int inputs, int outputs) : 
-    inputs(inputs), outputs(outputs), num_layers(0), valid(1), pars(0), train(0) {};
+    inputs(inputs), outputs(outputs), num_layers(0), valid(1), pars(0), train(0), max_batch(1) {
+#ifdef USE_MPI
+  net = NULL;
+#endif
+}
 Module::~Module() {}; 
 void Module::properties() {};
 void Module::add_layers(std::vector< std::vector <int> > config, double sigma) {};
+void Module::set_batch(int max_batch) {
+  this->max_batch = max_batch;
+}
 
 // clear accumulated partial derivaties 
 void Module::clear_partial() {
@@ -23,10 +31,10 @@ void Module::clear_partial() {
 }
 
 // compute partial derivative of loss with respect to parmeters 
-void Module::partial_param(double* in, double* delta) {
+void Module::partial_param(real* in, real* delta, int batch) {
   for (int i = 0; i < num_layers; i++) {
     if (L[i]->pars > 0) {
-      L[i]->partial_param(z[i], this->delta[i+1]);
+      L[i]->partial_param(z[i], this->delta[i+1], batch);
     }
   }
 }
@@ -40,6 +48,35 @@ void Module::update_param(double lr, int batch_size) {
   }
 }
 
+// notify layers that parameters have been modified
+void Module::param_changed() {
+  for (int i = 0; i < num_layers; i++) {
+    if (L[i]->pars > 0) {
+      L[i]->param_changed();
+    }
+  }
+}
+
+// use parameters of module with the same layers
+void Module::share_param(Module* source) {
+  for (int i = 0; i < num_layers; i++) {
+    if (L[i]->pars > 0) {
+      L[i]->share_param(source->L[i]);
+    }
+  }
+}
+
+// add partial derivatives from module with the same layers
+void Module::add_partial(Module* source) {
+  for (int i = 0; i < num_layers; i++) {
+    real* partial = L[i]->partial;
+    real* other = source->L[i]->partial;
+    for (int j = 0; j < L[i]->pars; j++) {
+      partial[j] += other[j];
+    }
+  }
+}
+
 #ifdef USE_MPI
 // syncs layer in all ranks to rank 0
 void Module::sync() {
@@ -65,8 +102,8 @@ Sequential::~Sequential() {
       delete L[i];
     }
     delete[] L;
-    // delete layer data
-    for (int i = 0; i <= num_layers; i++) {
+    // delete layer data (first and last are views)
+    for (int i = 1; i < num_layers; i++) {
       delete[] z[i];
       delete[] delta[i];
     }
@@ -82,6 +119,7 @@ Sequential::~Sequential() {
 void Sequential::add_layers(std::vector< std::vector <int> > config, double sigma) {
   // allocate layers, sizes, and types
   int ins, outs;
+  this->config = config;
   num_layers = config.size();
   L = new Layer*[num_layers];
   layer_sizes = new int[num_layers+1];
@@ -125,6 +163,9 @@ void Sequential::add_layers(std::vector< std::vector <int> > config, double sigm
         break;
     }
 
+    // size any per-sample storage in layer
+    L[i]->set_batch(max_batch);
+
     // take number of inputs and outputs from newly created layer
     ins  = L[i]->inputs;
     outs = L[i]->outputs;
@@ -132,21 +173,26 @@ void Sequential::add_layers(std::vector< std::vector <int> > config, double sigm
     // total number of parameters
     pars += L[i]->pars;
 
-    // if input-output mismatch, mark invalid
+    // if input-output mismatch, or layer invalid, mark invalid
     // only matters for layers after the first
     if (i > 0 && layer_sizes[i] != ins ) {
       valid = ERROR_SIZE_MISMATCH;
     }
+    if (L[i]->valid != 1) {
+      valid = L[i]->valid;
+    }
     layer_sizes[i]   = ins;
     layer_sizes[i+1] = outs;
   }
 
-  // allocate layer data z and delta (one more than number of layers)
-  z     = new double*[num_layers+1];
-  delta = new double*[num_layers+1];
+  // layer data z and delta (one more than number of layers)
+  // the first and last are views of the input and output of the module,
+  // set by forward and backward; the rest is allocated when first used
+  z     = new real*[num_layers+1];
+  delta = new real*[num_layers+1];
   for (int i = 0; i <= num_layers; i++) {
-    z[i] = new double[ layer_sizes[i] ];
-    delta[i] = new double[ layer_sizes[i] ];
+    z[i] = NULL;
+    delta[i] = NULL;
   }
   // validate number of inputs and outputs from sequential layer
   if (inputs != layer_sizes[0] || outputs != layer_sizes[num_layers]) {
@@ -154,6 +200,25 @@ void Sequential::add_layers(std::vector< std::vector <int> > config, double sigm
   }
 }
 
+// set maximum batch size
+// layer data z and delta hold max_batch samples, stored one after another
+void Sequential::set_batch(int max_batch) {
+  if (max_batch == this->max_batch) return;
+  this->max_batch = max_batch;
+  if (num_layers > 0) {
+    // reallocated when next used
+    for (int i = 1; i < num_layers; i++) {
+      delete[] z[i];
+      delete[] delta[i];
+      z[i] = NULL;
+      delta[i] = NULL;
+    }
+    for (int i = 0; i < num_layers; i++) {
+      L[i]->set_batch(max_batch);
+    }
+  }
+}
+
 // print parameters and properties
 void Sequential::properties() {
   printf("Sequential module: %d layers, %d parameters\n", num_layers, pars);
@@ -167,40 +232,53 @@ void Sequential::properties() {
   if (valid == ERROR_SEQUENTIAL_IO_MISMATCH) {
     std::cout << "error: input/output size mismatch for sequential layer" << std::endl;
   }
+  if (valid == ERROR_MAXPOOL_WINDOW) {
+    std::cout << "error: max pool window larger than " 
+        << 2*MAXPOOL_MAX_WINDOW+1 << " x " << 2*MAXPOOL_MAX_WINDOW+1 << std::endl;
+  }
   std::cout << std::endl;
 }
 
 // forward propagation on input
-void Sequential::forward(double* in, double* out) {
-  // copy input into sequential layer
-  for (int i = 0; i < inputs; i++) {
-    z[0][i] = in[i];
+void Sequential::forward(real* in, real* out, int batch) {
+  // first and last layers read the input and write the output directly
+  z[0] = in;
+  z[num_layers] = out;
+  if (num_layers > 1 && z[1] == NULL) {
+    for (int i = 1; i < num_layers; i++) {
+      z[i] = new real[ max_batch*layer_sizes[i] ];
+    }
   }
   // forward propagate through network
   for (int i = 0; i < num_layers; i++) {
     L[i]->train = train;
-    L[i]->forward(z[i],z[i+1]);
-  }
-  // copy output from sequential layer into output
-  for (int i = 0; i < outputs; i++) {
-    out[i] = z[num_layers][i];
+    L[i]->forward(z[i],z[i+1],batch);
   }
 }
 
 // forward propagation on output
-void Sequential::backward(double* in, double* out, double* delta) {
-  // copy output into net
-  double outsum = 0;
-  for (int i = 0; i < outputs; i++) {
-    this->delta[num_layers][i] = out[i];
+void Sequential::backward(real* in, real* out, real* delta, int batch) {
+  // last and first layers read the output delta and write the input delta
+  // directly
+  this->delta[num_layers] = out;
+  this->delta[0] = delta;
+  if (num_layers > 1 && this->delta[1] == NULL) {
+    for (int i = 1; i < num_layers; i++) {
+      this->delta[i] = new real[ max_batch*layer_sizes[i] ];
+    }
   }
   // work backwards from last layer
   for (int i = num_layers - 1; i >= 0; i--) {
-    L[i]->backward(z[i], this->delta[i+1], this->delta[i]);
-  }
-  // copy final delta
-  for (int i = 0; i < inputs; i++) {
-    delta[i] = this->delta[0][i];
+    L[i]->backward(z[i], this->delta[i+1], this->delta[i], batch);
+#ifdef USE_MPI
+    // partials of layer are final now, so their reduction can start
+    if (net != NULL) {
+      if (L[i]->pars > 0) {
+        L[i]->partial_param(z[i], this->delta[i+1], batch);
+      }
+      net->partial_ready(L[i]);
+    }
+#endif
   }
 }
 
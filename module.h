@@ -6,6 +6,8 @@
 #ifndef _MODULE
 #define _MODULE
 
+class Net;
+
 // types of modules
 #define SEQUENTIAL 1001
 
@@ -26,6 +28,9 @@ class Module {
     // are we training or not?
     int train;
 
+    // maximum number of samples in a batch
+    int max_batch;
+
     // number of layers
     int num_layers;
     // input/output sizes of layers
@@ -35,27 +40,42 @@ class Module {
     // is network valid?
     int valid;
 
+    // configuration of layers (as passed to add_layers)
+    std::vector< std::vector<int> > config;
+
     // layers
     Layer** L;
     // z: data (inputs and outputs from layers) 
-    double** z;
+    real** z;
     // delta: partial derivatives with respect to layer outputs z
-    double** delta;
+    real** delta;
+    // z[0], z[num_layers] and delta[0], delta[num_layers] are not allocated: 
+    // forward and backward point them at their input and output; the others
+    // are allocated by the first forward and backward after set_batch
+
+#ifdef USE_MPI
+    // if set, backward also accumulates the parameter partials of each layer
+    // as soon as its delta is known, and reports the layer to net->partial_ready
+    Net* net;
+#endif
 
     // constructor and destructor
     Module(int inputs, int outputs);
     virtual ~Module(); 
     virtual void add_layers(std::vector< std::vector <int> > config, double sigma);
 
+    // set maximum batch size (reallocates layer data)
+    virtual void set_batch(int max_batch);
+
     // print parameters and properties
     virtual void properties();
 
-    // forward and backward propagation
-    virtual void forward(double* in, double* out) = 0;
-    virtual void backward(double* in, double* out, double* delta) = 0;
+    // forward and backward propagation on a batch of samples
+    virtual void forward(real* in, real* out, int batch) = 0;
+    virtual void backward(real* in, real* out, real* delta, int batch) = 0;
 
     // compute partial derivative of loss with respect to parmeters 
-    void partial_param(double* in, double* delta);
+    void partial_param(real* in, real* delta, int batch);
 
     // clear accumulated partial derivaties 
     void clear_partial();
@@ -63,6 +83,15 @@ class Module {
     // update parameters using accumulated partial derivatives
     void update_param(double lr, int batch_size);
 
+    // notify layers that parameters have been modified
+    void param_changed();
+
+    // use parameters of module with the same layers in place of own
+    void share_param(Module* source);
+
+    // add partial derivatives accumulated in module with the same layers
+    void add_partial(Module* source);
+
 #ifdef USE_MPI
     // syncs layer in all ranks to rank 0
     void sync();
@@ -82,18 +111,21 @@ class Sequential : public Module {
     // add layers
     void add_layers(std::vector< std::vector <int> > config, double sigma);
 
+    // set maximum batch size (reallocates layer data)
+    void set_batch(int max_batch);
+
     // // print parameters and properties
     void properties();
 
     // forward and backward propagation
-    void forward(double* in, double* out);
-    void backward(double* in, double* out, double* delta);
+    void forward(real* in, real* out, int batch);
+    void backward(real* in, real* out, real* delta, int batch);
 
     // clear accumulated partial derivaties 
     void clear_partial();
 
     // compute partial derivative of loss with respect to parmeters 
-    void partial_param(double* in, double* delta);
+    void partial_param(real* in, real* delta, int batch);
 
     // update parameters using accumulated partial derivatives
     void update_param(double lr, int batch_size);
@@ -1,11 +1,60 @@
 #include "net.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef USE_MPI
+  #include "mpi.h"
+#endif
+
+// copy n byte inputs into x, scaled
+void scale_input(int n, const uint8_t* in, real* x) {
+  const real scale = INPUT_SCALE;
+  for (int i = 0; i < n; i++) {
+    x[i] = scale*in[i];
+  }
+}
 
 // constructor
 Net::Net(std::vector< std::vector <int> > config) : 
-      num_modules( config.size() ), valid(1), pars(0) {
+      num_modules( config.size() ), valid(1), pars(0), max_batch(1), 
+      config(config), layer_config(config.size()), 
+      arena_size(0), param(NULL), partial(NULL), owns_param(1), mapped(NULL), mapped_size(0), plan(NULL) {
   int ins, outs;
 
+#ifdef USE_MPI
+  bucket_size = DEFAULT_BUCKET_SIZE;
+  overlap = 0;
+  hierarchical = 0;
+  ranks_per_node = 0;
+  node_comm = MPI_COMM_NULL;
+  leader_comm = MPI_COMM_NULL;
+  node_rank = 0;
+  node_size = 1;
+  num_nodes = 1;
+  window = MPI_WIN_NULL;
+  shared = NULL;
+  window_bucket = 0;
+  sparsity = 0;
+  residual = NULL;
+  local_steps = 0;
+  snapshot = NULL;
+  average = NULL;
+  average_request = MPI_REQUEST_NULL;
+  average_pending = 0;
+  bytes_sent = 0;
+  num_updates = 0;
+  reduce_done = 0;
+  reduce_launched = 0;
+#endif
+
   // allocate modules, sizes, and types
   M = new Module*[num_modules];
   module_sizes = new int[num_modules+1];
@@ -37,12 +86,15 @@ Net::Net(std::vector< std::vector <int> > config) :
     module_sizes[i+1] = outs;
   }
 
-  // allocate module data z and delta (one more than number of modules)
-  z     = new double*[num_modules+1];
-  delta = new double*[num_modules+1];
+  // module data z and delta (one more than number of modules)
+  // z[0] and delta[num_modules] point at the data of the caller of forward
+  // and backward; the rest is allocated by the first forward and backward
+  // (evaluation with the inference plan needs none of it)
+  z     = new real*[num_modules+1];
+  delta = new real*[num_modules+1];
   for (int i = 0; i <= num_modules; i++) {
-    z[i] = new double[ module_sizes[i] ];
-    delta[i] = new double[ module_sizes[i] ];
+    z[i] = NULL;
+    delta[i] = NULL;
   }
 }
 
@@ -53,74 +105,240 @@ Net::~Net() {
     delete M[i];
   }
   delete[] M;
-  // delete module data
+  // delete module data (other than that of callers)
   for (int i = 0; i <= num_modules; i++) {
-    delete[] z[i];
-    delete[] delta[i];
+    if (i > 0) delete[] z[i];
+    if (i < num_modules) delete[] delta[i];
   }
   delete[] z;
   delete[] delta;
+  delete plan;
   // delete module sizes
   delete[] module_sizes;
+  // delete arena (layers only hold views into it)
+  if (owns_param) free(param);
+  free(partial);
+  if (mapped != NULL) munmap(mapped, mapped_size);
+#ifdef USE_MPI
+  // free shared window and communicators (unless MPI is already finalized)
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (!finalized) set_hierarchical(0, 0);
+  delete[] residual;
+  delete[] snapshot;
+  delete[] average;
+#endif
 }
 
 void Net::add_layers(int module_id, std::vector< std::vector <int> > config, double sigma) {
   if (module_id >= 0 && module_id < num_modules) {
+    M[module_id]->set_batch(max_batch);
     M[module_id]->add_layers(config, sigma);
+    layer_config[module_id] = config;
     pars += M[module_id]->pars;
+    // invalid module (reported by its properties)
+    if (M[module_id]->valid != 1) {
+      valid = M[module_id]->valid;
+    }
+    build_arena();
+    delete plan;
+    plan = NULL;
+  }
+}
+
+// number of values a layer takes up in the arena
+static int arena_pars(Layer* L) {
+  const int n = ARENA_ALIGN/sizeof(real);
+  return (L->pars + n - 1)/n*n;
+}
+
+// allocate cleared, aligned slab
+static real* arena_alloc(int size) {
+  real* p = NULL;
+  if (posix_memalign((void**) &p, ARENA_ALIGN, sizeof(real)*std::max(size, 1)) != 0) {
+    throw std::bad_alloc();
+  }
+  std::fill(p, p + size, 0);
+  return p;
+}
+
+// lay out parameters and partials of all layers in the arena
+// current parameters are moved into the new slabs, partials are cleared
+void Net::build_arena() {
+  int size = 0;
+  for (int m = 0; m < num_modules; m++) {
+    for (int i = 0; i < M[m]->num_layers; i++) {
+      size += arena_pars(M[m]->L[i]);
+    }
+  }
+  real* p = arena_alloc(size);
+  real* q = arena_alloc(size);
+  int offset = 0;
+  for (int m = num_modules - 1; m >= 0; m--) {
+    for (int i = M[m]->num_layers - 1; i >= 0; i--) {
+      Layer* L = M[m]->L[i];
+      if (L->pars > 0) {
+        L->set_storage(p + offset, q + offset);
+        offset += arena_pars(L);
+      }
+    }
+  }
+  if (owns_param) free(param);
+  free(partial);
+  param = p;
+  partial = q;
+  owns_param = 1;
+  arena_size = size;
+}
+
+// set maximum batch size
+// module data z and delta hold max_batch samples, stored one after another
+void Net::set_batch(int max_batch) {
+  if (max_batch == this->max_batch) return;
+  this->max_batch = max_batch;
+  delete plan;
+  plan = NULL;
+  // reallocated when next used
+  for (int i = 0; i <= num_modules; i++) {
+    if (i > 0) {
+      delete[] z[i];
+      z[i] = NULL;
+    }
+    if (i < num_modules) {
+      delete[] delta[i];
+      delta[i] = NULL;
+    }
+  }
+  for (int i = 0; i < num_modules; i++) {
+    M[i]->set_batch(max_batch);
   }
 }
 
 // forward propagation on input (for training or evaluation)
-void Net::forward(double* in, int train) {
-  // copy input into net
-  for (int i = 0; i < module_sizes[0]; i++) {
-    z[0][i] = in[i];
+void Net::forward(real* in, int train, int batch) {
+  // input of net is the data of the caller (not copied)
+  z[0] = in;
+  if (z[num_modules] == NULL) {
+    for (int i = 1; i <= num_modules; i++) {
+      z[i] = new real[ max_batch*module_sizes[i] ];
+    }
   }
   // forward propagate through network
   for (int i = 0; i < num_modules; i++) {
     M[i]->train = train;
-    M[i]->forward(z[i],z[i+1]);
+    M[i]->forward(z[i],z[i+1],batch);
   }
 }
 
+// compile inference plan
+void Net::compile() {
+  delete plan;
+  plan = new InferencePlan(this);
+}
+
+// evaluate network with inference plan
+// the plan is sized for max_batch samples, so larger batches are rejected
+real* Net::infer(real* in, int batch) {
+  if (batch > max_batch) return NULL;
+  if (plan == NULL) compile();
+  return plan->forward(in, batch);
+}
+
 // backward propagation on output
-void Net::backward(double* out) {
-  // copy output into net
-  for (int i = 0; i < module_sizes[num_modules]; i++) {
-    delta[num_modules][i] = out[i];
+void Net::backward(real* out, int batch) {
+  // output delta of net is the data of the caller (not copied)
+  delta[num_modules] = out;
+  if (delta[0] == NULL) {
+    for (int i = 0; i < num_modules; i++) {
+      delta[i] = new real[ max_batch*module_sizes[i] ];
+    }
   }
   // work backwards from last module
   for (int i = num_modules - 1; i >= 0; i--) {
-    M[i]->backward(z[i], delta[i+1], delta[i]);
+    M[i]->backward(z[i], delta[i+1], delta[i], batch);
   }
 }
 
 // clear accumulated partial derivaties 
 void Net::clear_partial() {
+  std::fill(partial, partial + arena_size, 0);
+}
+
+// update/accumulate partial derivaties 
+void Net::partial_param(int batch) {
   for (int i = 0; i < num_modules; i++) {
+#ifdef USE_MPI
+    // already accumulated during backward
+    if (M[i]->net != NULL) continue;
+#endif
     if (M[i]->pars > 0) {
-      M[i]->clear_partial();
+      M[i]->partial_param(z[i], delta[i+1], batch);
     }
   }
 }
 
-// update/accumulate partial derivaties 
-void Net::partial_param() {
+// update parameters using accumulated partial derivatives
+void Net::update_param(double lr, int batch_size) {
+#ifdef USE_MPI
+  // with local SGD, parameters are averaged instead (below)
+  if (local_steps == 0) {
+    if (sparsity > 0) sparse_allreduce_partial();
+    else if (overlap) finish_allreduce();
+    else allreduce_partial();
+  }
+  num_updates++;
+#endif
+  real step = lr/batch_size;
+  for (int i = 0; i < arena_size; i++) {
+    param[i] -= step*partial[i];
+  }
+#ifdef USE_MPI
+  // apply averaging started by an earlier update, and start the next one
+  if (local_steps > 0) {
+    finish_average();
+    if (num_updates % local_steps == 0) {
+      start_average();
+      if (!overlap) finish_average();
+    }
+  }
+#endif
+  param_changed();
+}
+
+// notify layers that parameters have been modified
+void Net::param_changed() {
   for (int i = 0; i < num_modules; i++) {
     if (M[i]->pars > 0) {
-      M[i]->partial_param(z[i], delta[i+1]);
+      M[i]->param_changed();
     }
   }
 }
 
-// update parameters using accumulated partial derivatives
-void Net::update_param(double lr, int batch_size) {
+// make replica sharing parameters
+// layers are built with unit sigma, but their initial parameters are discarded
+// (the replica has the same arena layout, and uses this network's parameter slab)
+Net* Net::replicate() {
+  Net* R = new Net(config);
+  R->set_batch(max_batch);
+  for (int i = 0; i < num_modules; i++) {
+    R->add_layers(i, layer_config[i], 1.0);
+  }
   for (int i = 0; i < num_modules; i++) {
     if (M[i]->pars > 0) {
-      M[i]->update_param(lr, batch_size);
+      R->M[i]->share_param(M[i]);
     }
   }
+  free(R->param);
+  R->param = param;
+  R->owns_param = 0;
+  return R;
+}
+
+// add partial derivatives from replica
+void Net::add_partial(Net* N) {
+  for (int i = 0; i < arena_size; i++) {
+    partial[i] += N->partial[i];
+  }
 }
 
 // print properties
@@ -136,14 +354,470 @@ void Net::properties() {
   std::cout << std::endl;
 }
 
+// checkpoint header
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t real_size;
+  uint64_t config_size;
+  uint64_t arena_size;
+  uint64_t param_offset;
+  uint64_t updates;
+};
+static const char checkpoint_magic[8] = {'M','O','D','N','E','T','C','K'};
+
+// configuration of modules and layers as a list of ints: number of modules,
+// each module (length, values), then for each module its number of layers 
+// and each layer (length, values)
+static std::vector<int> flat_config(Net* N) {
+  std::vector<int> c(1, N->num_modules);
+  for (int m = 0; m < N->num_modules; m++) {
+    c.push_back(N->config[m].size());
+    c.insert(c.end(), N->config[m].begin(), N->config[m].end());
+  }
+  for (int m = 0; m < N->num_modules; m++) {
+    c.push_back(N->layer_config[m].size());
+    for (size_t i = 0; i < N->layer_config[m].size(); i++) {
+      c.push_back(N->layer_config[m][i].size());
+      c.insert(c.end(), N->layer_config[m][i].begin(), N->layer_config[m][i].end());
+    }
+  }
+  return c;
+}
+
+// save checkpoint
+// written to a temporary file which then replaces filename, so that a 
+// checkpoint that is mapped (by this or any other process) is never modified
+int Net::save(const char* filename) {
+  std::string tmp = std::string(filename) + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (!fp) return ERROR_CHECKPOINT_FILE;
+
+  std::vector<int> c = flat_config(this);
+  CheckpointHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, checkpoint_magic, sizeof(h.magic));
+  h.version = CHECKPOINT_VERSION;
+  h.real_size = sizeof(real);
+  h.config_size = c.size();
+  h.arena_size = arena_size;
+  size_t end = sizeof(h) + sizeof(int)*c.size();
+  h.param_offset = (end + CHECKPOINT_ALIGN - 1)/CHECKPOINT_ALIGN*CHECKPOINT_ALIGN;
+#ifdef USE_MPI
+  h.updates = num_updates;
+#endif
+
+  std::vector<char> pad(h.param_offset - end, 0);
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+      fwrite(c.data(), sizeof(int), c.size(), fp) == c.size() &&
+      fwrite(pad.data(), 1, pad.size(), fp) == pad.size() &&
+      fwrite(param, sizeof(real), arena_size, fp) == (size_t) arena_size;
+  if (fclose(fp) != 0) ok = 0;
+  if (ok && rename(tmp.c_str(), filename) != 0) ok = 0;
+  if (!ok) remove(tmp.c_str());
+  return ok ? 0 : ERROR_CHECKPOINT_FILE;
+}
+
+// load checkpoint
+int Net::load(const char* filename, int map) {
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) return ERROR_CHECKPOINT_FILE;
+
+  // check header and configuration
+  int error = 0;
+  CheckpointHeader h;
+  std::vector<int> c = flat_config(this);
+  std::vector<int> saved;
+  struct stat st;
+  if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, checkpoint_magic, sizeof(h.magic)) != 0 ||
+      h.version != CHECKPOINT_VERSION || h.real_size != sizeof(real) ||
+      fstat(fileno(fp), &st) != 0 || 
+      (uint64_t) st.st_size < h.param_offset + sizeof(real)*h.arena_size) {
+    error = ERROR_CHECKPOINT_FORMAT;
+  }
+  else if (h.config_size != c.size() || h.arena_size != (uint64_t) arena_size) {
+    error = ERROR_CHECKPOINT_CONFIG;
+  }
+  else {
+    saved.resize(c.size());
+    if (fread(saved.data(), sizeof(int), saved.size(), fp) != saved.size()) {
+      error = ERROR_CHECKPOINT_FORMAT;
+    }
+    else if (saved != c) {
+      error = ERROR_CHECKPOINT_CONFIG;
+    }
+  }
+
+  // map parameters from file (page aligned), or read them into the arena
+  void* p = MAP_FAILED;
+  if (!error && map) {
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+  }
+  if (!error && p != MAP_FAILED) {
+    if (owns_param) free(param);
+    if (mapped != NULL) munmap(mapped, mapped_size);
+    mapped = p;
+    mapped_size = st.st_size;
+    param = (real*) ((char*) p + h.param_offset);
+    owns_param = 0;
+    // point layers at their parameters in the mapped arena
+    int offset = 0;
+    for (int m = num_modules - 1; m >= 0; m--) {
+      for (int i = M[m]->num_layers - 1; i >= 0; i--) {
+        Layer* L = M[m]->L[i];
+        if (L->pars > 0) {
+          L->param = param + offset;
+          offset += arena_pars(L);
+        }
+      }
+    }
+  }
+  else if (!error) {
+    if (fseek(fp, h.param_offset, SEEK_SET) != 0 ||
+        fread(param, sizeof(real), arena_size, fp) != (size_t) arena_size) {
+      error = ERROR_CHECKPOINT_FORMAT;
+    }
+  }
+  fclose(fp);
+  if (error) return error;
+
+#ifdef USE_MPI
+  num_updates = h.updates;
+  // the residuals of sparse reduction and the parameters of each rank under
+  // local SGD are not saved: training continues from the saved parameters
+  // with residuals of zero
+  if (residual != NULL) std::fill(residual, residual + arena_size, 0);
+  int myid;
+  MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+  if (myid == 0 && (sparsity > 0 || local_steps > 0)) {
+    std::cerr << "warning: checkpoint " << filename << " has no " 
+      << (sparsity > 0 ? "sparse reduction residuals" : "local SGD state") 
+      << "; continuing from its parameters only" << std::endl;
+  }
+#endif
+  param_changed();
+  return 0;
+}
+
 #ifdef USE_MPI
+// synchronize ranks of node, and their view of the shared window
+static void node_barrier(Net* N) {
+  MPI_Win_sync(N->window);
+  MPI_Barrier(N->node_comm);
+  MPI_Win_sync(N->window);
+}
+
 // sync paramaters of all ranks in all modules to rank 0
+// (hierarchical: broadcast among leaders, then fan out through the window)
 void Net::sync() {
+  if (!hierarchical) {
+    MPI_Bcast(param, arena_size, MPI_REAL_T, 0, MPI_COMM_WORLD);
+  } else {
+    real* result = shared + node_size*window_bucket;
+    for (int start = 0; start < arena_size; start += window_bucket) {
+      int count = std::min(window_bucket, arena_size - start);
+      if (node_rank == 0) {
+        MPI_Bcast(param + start, count, MPI_REAL_T, 0, leader_comm);
+        std::copy(param + start, param + start + count, result);
+      }
+      node_barrier(this);
+      if (node_rank > 0) {
+        std::copy(result, result + count, param + start);
+      }
+      node_barrier(this);
+    }
+  }
+  param_changed();
+}
+
+// set number of values per gradient bucket
+void Net::set_bucket_size(int bucket_size) {
+  this->bucket_size = std::max(bucket_size, 1);
+  set_overlap(overlap);
+  if (hierarchical) set_hierarchical(hierarchical, ranks_per_node);
+}
+
+// set hierarchical reduction
+// collective over all ranks; call after all layers have been added
+void Net::set_hierarchical(int hierarchical, int ranks_per_node) {
+  // free previous window and communicators
+  if (window != MPI_WIN_NULL) {
+    MPI_Win_unlock_all(window);
+    MPI_Win_free(&window);
+    shared = NULL;
+  }
+  if (node_comm != MPI_COMM_NULL) MPI_Comm_free(&node_comm);
+  if (leader_comm != MPI_COMM_NULL) MPI_Comm_free(&leader_comm);
+  node_rank = 0;
+  node_size = 1;
+  num_nodes = 1;
+
+  this->hierarchical = hierarchical;
+  this->ranks_per_node = std::max(ranks_per_node, 0);
+  if (!hierarchical) return;
+
+  // ranks sharing memory, split into groups of ranks_per_node if given
+  int myid;
+  MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myid, MPI_INFO_NULL, &node_comm);
+  if (this->ranks_per_node > 0) {
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm machine = node_comm;
+    MPI_Comm_split(machine, node_rank/this->ranks_per_node, node_rank, &node_comm);
+    MPI_Comm_free(&machine);
+  }
+  MPI_Comm_rank(node_comm, &node_rank);
+  MPI_Comm_size(node_comm, &node_size);
+
+  // leaders (rank 0 of each node; world rank 0 is leader 0)
+  MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, myid, &leader_comm);
+  int leader = (node_rank == 0);
+  MPI_Allreduce(&leader, &num_nodes, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  // window memory is all allocated by the leader
+  window_bucket = std::max(std::min(bucket_size, arena_size), 1);
+  MPI_Aint bytes = node_rank == 0 ? sizeof(real)*(node_size + 1)*(MPI_Aint) window_bucket : 0;
+  MPI_Win_allocate_shared(bytes, sizeof(real), MPI_INFO_NULL, node_comm, &shared, &window);
+  MPI_Aint size;
+  int disp;
+  MPI_Win_shared_query(window, 0, &size, &disp, &shared);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+}
+
+// set overlap of reduction with backward propagation
+// call after all layers have been added
+void Net::set_overlap(int overlap) {
+  // sparse reduction needs all partials of the update before it can select
+  if (sparsity > 0) overlap = 0;
+  this->overlap = overlap;
+  requests.assign( (arena_size + bucket_size - 1)/bucket_size, MPI_REQUEST_NULL );
+  reduce_done = 0;
+  reduce_launched = 0;
+  // partials are only reduced during backward propagation without local SGD
   for (int i = 0; i < num_modules; i++) {
-    if (M[i]->pars > 0) {
-      M[i]->sync();
+    M[i]->net = (overlap && local_steps == 0) ? this : NULL;
+  }
+}
+
+// sum count values of x over all ranks through the shared window
+static void hierarchical_allreduce(Net* N, real* x, int count) {
+  int n = N->node_size;
+  real* result = N->shared + n*N->window_bucket;
+  std::copy(x, x + count, N->shared + N->node_rank*N->window_bucket);
+  node_barrier(N);
+  // each rank sums its share of the values over all ranks of node
+  int lo = (long) count*N->node_rank/n;
+  int hi = (long) count*(N->node_rank + 1)/n;
+  std::copy(N->shared + lo, N->shared + hi, result + lo);
+  for (int r = 1; r < n; r++) {
+    real* y = N->shared + r*N->window_bucket;
+    for (int i = lo; i < hi; i++) {
+      result[i] += y[i];
     }
   }
+  node_barrier(N);
+  // leaders sum over nodes
+  if (N->node_rank == 0 && N->num_nodes > 1) {
+    MPI_Allreduce(MPI_IN_PLACE, result, count, MPI_REAL_T, MPI_SUM, N->leader_comm);
+    N->bytes_sent += sizeof(real)*(long long) count;
+  }
+  node_barrier(N);
+  std::copy(result, result + count, x);
 }
-#endif
 
+// sum partial derivatives over all ranks, one bucket at a time
+void Net::allreduce_partial() {
+  for (int start = 0; start < arena_size; start += bucket_size) {
+    int count = std::min(bucket_size, arena_size - start);
+    if (hierarchical) hierarchical_allreduce(this, partial + start, count);
+    else {
+      MPI_Allreduce(MPI_IN_PLACE, partial + start, count, MPI_REAL_T, MPI_SUM, MPI_COMM_WORLD);
+      bytes_sent += sizeof(real)*(long long) count;
+    }
+  }
+}
+
+// launch reduction of bucket k
+// (hierarchical reduction is not split into non-blocking steps: it is done 
+// right away, in between backward propagation of layers)
+static void launch_bucket(Net* N, int k) {
+  int start = k*N->bucket_size;
+  int count = std::min(N->bucket_size, N->arena_size - start);
+  if (N->hierarchical) {
+    hierarchical_allreduce(N, N->partial + start, count);
+    N->requests[k] = MPI_REQUEST_NULL;
+  } else {
+    MPI_Iallreduce(MPI_IN_PLACE, N->partial + start, count, MPI_REAL_T, MPI_SUM, 
+        MPI_COMM_WORLD, &N->requests[k]);
+    N->bytes_sent += sizeof(real)*(long long) count;
+  }
+}
+
+// layers complete in the order they are laid out in the arena, so every 
+// bucket ending at or before the values completed so far is ready
+void Net::partial_ready(Layer* L) {
+  int num_buckets = requests.size();
+  if (L->pars > 0) reduce_done += arena_pars(L);
+  while (reduce_launched < num_buckets &&
+      std::min((reduce_launched + 1)*bucket_size, arena_size) <= reduce_done) {
+    launch_bucket(this, reduce_launched);
+    reduce_launched++;
+  }
+  // give MPI a chance to progress collectives already in flight
+  int flag;
+  MPI_Testall(reduce_launched, requests.data(), &flag, MPI_STATUSES_IGNORE);
+}
+
+// launch remaining buckets
+void Net::start_allreduce() {
+  int num_buckets = requests.size();
+  reduce_done = arena_size;
+  while (reduce_launched < num_buckets) {
+    launch_bucket(this, reduce_launched);
+    reduce_launched++;
+  }
+}
+
+// wait for all buckets
+void Net::finish_allreduce() {
+  start_allreduce();
+  MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+  reduce_done = 0;
+  reduce_launched = 0;
+}
+// values each layer sends with sparse reduction of the given sparsity
+static int sparse_count(Layer* L, double sparsity) {
+  return std::min(L->pars, std::max(1, (int) std::ceil(sparsity*L->pars)));
+}
+
+// set fraction of partials sent by sparse reduction
+// every rank receives the (index, value) pairs of all ranks, so sparsities
+// for which that is no less than the dense partials fall back to dense 
+// reduction
+void Net::set_sparsity(double sparsity) {
+  this->sparsity = (sparsity > 0 && sparsity < 1) ? sparsity : 0;
+  if (this->sparsity > 0) {
+    int numprocs, myid;
+    MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+    long long count = 0;
+    for (int m = 0; m < num_modules; m++) {
+      for (int i = 0; i < M[m]->num_layers; i++) {
+        if (M[m]->L[i]->pars > 0) count += sparse_count(M[m]->L[i], this->sparsity);
+      }
+    }
+    if (count*numprocs*(long long) (sizeof(int) + sizeof(real)) >= 
+        (long long) arena_size*sizeof(real)) {
+      if (myid == 0) {
+        std::cerr << "warning: sparsity " << sparsity << " gathers no less than " 
+          << "dense reduction over " << numprocs << " ranks; using dense reduction" 
+          << std::endl;
+      }
+      this->sparsity = 0;
+    }
+  }
+  delete[] residual;
+  residual = NULL;
+  if (this->sparsity > 0) {
+    residual = new real[arena_size];
+    std::fill(residual, residual + arena_size, 0);
+    set_overlap(0);
+  }
+}
+
+// sparse reduction (top-k with error feedback)
+// every layer sends the same number of values on every rank, so the selected
+// values of all ranks are gathered with one collective, and summed into partial
+void Net::sparse_allreduce_partial() {
+  int numprocs;
+  MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
+  sparse_index.clear();
+  sparse_value.clear();
+
+  // select largest accumulated partials of each layer (in arena order)
+  std::vector<int> order;
+  int offset = 0;
+  for (int m = num_modules - 1; m >= 0; m--) {
+    for (int i = M[m]->num_layers - 1; i >= 0; i--) {
+      Layer* L = M[m]->L[i];
+      if (L->pars == 0) continue;
+      real* g = partial + offset;
+      real* r = residual + offset;
+      for (int j = 0; j < L->pars; j++) {
+        r[j] += g[j];
+      }
+      int k = sparse_count(L, sparsity);
+      order.resize(L->pars);
+      for (int j = 0; j < L->pars; j++) {
+        order[j] = j;
+      }
+      std::nth_element(order.begin(), order.begin() + (k - 1), order.end(),
+          [r](int a, int b) { return std::fabs(r[a]) > std::fabs(r[b]); });
+      for (int j = 0; j < k; j++) {
+        sparse_index.push_back(offset + order[j]);
+        sparse_value.push_back(r[order[j]]);
+        r[order[j]] = 0;
+      }
+      offset += arena_pars(L);
+    }
+  }
+
+  // gather selections of all ranks, and sum them
+  int count = sparse_index.size();
+  all_index.resize((size_t) numprocs*count);
+  all_value.resize((size_t) numprocs*count);
+  MPI_Allgather(sparse_index.data(), count, MPI_INT, all_index.data(), count, MPI_INT, 
+      MPI_COMM_WORLD);
+  MPI_Allgather(sparse_value.data(), count, MPI_REAL_T, all_value.data(), count, MPI_REAL_T, 
+      MPI_COMM_WORLD);
+  bytes_sent += (sizeof(int) + sizeof(real))*(long long) count;
+  std::fill(partial, partial + arena_size, 0);
+  for (size_t j = 0; j < all_index.size(); j++) {
+    partial[ all_index[j] ] += all_value[j];
+  }
+}
+// set number of updates between averaging of parameters
+void Net::set_local_steps(int local_steps) {
+  finish_average();
+  this->local_steps = std::max(local_steps, 0);
+  delete[] snapshot;
+  delete[] average;
+  snapshot = NULL;
+  average = NULL;
+  if (this->local_steps > 0) {
+    snapshot = new real[arena_size];
+    average = new real[arena_size];
+  }
+  set_overlap(overlap);
+}
+
+// start averaging parameters
+// (hierarchical: summed right away through the shared window, one bucket at a time)
+void Net::start_average() {
+  std::copy(param, param + arena_size, snapshot);
+  if (hierarchical) {
+    std::copy(snapshot, snapshot + arena_size, average);
+    for (int start = 0; start < arena_size; start += bucket_size) {
+      hierarchical_allreduce(this, average + start, std::min(bucket_size, arena_size - start));
+    }
+  } else {
+    MPI_Iallreduce(snapshot, average, arena_size, MPI_REAL_T, MPI_SUM, MPI_COMM_WORLD, 
+        &average_request);
+    bytes_sent += sizeof(real)*(long long) arena_size;
+  }
+  average_pending = 1;
+}
+
+// apply average: parameters keep any updates made since the snapshot
+void Net::finish_average() {
+  if (!average_pending) return;
+  int numprocs;
+  MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
+  MPI_Wait(&average_request, MPI_STATUS_IGNORE);
+  real scale = 1.0/numprocs;
+  for (int i = 0; i < arena_size; i++) {
+    param[i] += scale*average[i] - snapshot[i];
+  }
+  average_pending = 0;
+}
+#endif
@@ -1,5 +1,30 @@
 #include "module.h"
+#include "plan.h"
 #include <vector>
+#include <stdint.h>
+
+#ifdef USE_MPI
+  #include "mpi.h"
+#endif
+
+// default number of values in each gradient bucket reduced across ranks
+#define DEFAULT_BUCKET_SIZE (1 << 18)
+
+// alignment (bytes) of the parameter and partial arenas, and of each layer in them
+#define ARENA_ALIGN 64
+
+// checkpoint file format version, and alignment (bytes) of parameters in file
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGN 4096
+
+// checkpoint errors
+#define ERROR_CHECKPOINT_FILE -11
+#define ERROR_CHECKPOINT_FORMAT -12
+#define ERROR_CHECKPOINT_CONFIG -13
+
+// data sets store inputs as bytes, scaled by INPUT_SCALE (to [0,1]) as they
+// are copied into a batch
+#define INPUT_SCALE (1.0/255)
 
 #ifndef _NET
 #define _NET
@@ -18,44 +43,217 @@ class Net {
     // total number of parameters
     int pars;
 
+    // maximum number of samples in a batch
+    int max_batch;
+
+    // configuration of modules, and of layers in each module
+    std::vector< std::vector<int> > config;
+    std::vector< std::vector< std::vector<int> > > layer_config;
+
+    // arena: parameters of all layers in one ARENA_ALIGN aligned slab, and 
+    // partials in another of the same layout; layers are laid out in reverse 
+    // order (the order in which backward propagation completes them), each 
+    // padded to a multiple of ARENA_ALIGN bytes, and hold views into the slabs
+    int arena_size;
+    real* param;
+    real* partial;
+    // does net own param? (not if it shares the parameters of another net,
+    // or they are mapped from a checkpoint)
+    int owns_param;
+    // checkpoint mapped by load (NULL if none)
+    void* mapped;
+    size_t mapped_size;
+
+#ifdef USE_MPI
+    // the partial arena is reduced across ranks in place, in buckets of up to
+    // bucket_size values, with one collective per bucket
+    int bucket_size;
+
+    // overlap reduction with backward propagation: each bucket is reduced with 
+    // a non-blocking collective as soon as backward has completed its partials
+    int overlap;
+    // values of partials completed so far, and buckets launched
+    int reduce_done;
+    int reduce_launched;
+    std::vector<MPI_Request> requests;
+
+    // hierarchical reduction: ranks on the same node combine their buckets 
+    // through a shared memory window, only one leader per node takes part in
+    // the collective across nodes, and the result is read back from the window
+    // a node is the set of ranks sharing memory, or with ranks_per_node > 0 a 
+    // group of that many of them (to simulate several nodes on one machine)
+    int hierarchical;
+    int ranks_per_node;
+    // ranks of this node and leaders of all nodes (leader_comm is MPI_COMM_NULL 
+    // on other ranks), rank within node and number of nodes
+    MPI_Comm node_comm;
+    MPI_Comm leader_comm;
+    int node_rank, node_size, num_nodes;
+    // shared window: one bucket for each rank of node, and one for the result
+    MPI_Win window;
+    real* shared;
+    int window_bucket;
+
+    // sparse reduction: with 0 < sparsity < 1, each rank sends only that 
+    // fraction of the partials of each layer, the ones largest in magnitude, 
+    // with their indices; the rest is kept in residual and added to the 
+    // partials of the next update (error feedback)
+    double sparsity;
+    real* residual;
+    // indices into the arena and values sent by this rank, and gathered from all
+    std::vector<int> sparse_index, all_index;
+    std::vector<real> sparse_value, all_value;
+
+    // local SGD: with local_steps > 0, each rank updates its parameters with
+    // its own partials only, and parameters are averaged over all ranks every
+    // local_steps updates; with overlap, a snapshot of the parameters is 
+    // averaged during the next update, and the change averaging made to the 
+    // snapshot is then applied to the parameters
+    int local_steps;
+    real* snapshot;
+    real* average;
+    MPI_Request average_request;
+    int average_pending;
+
+    // bytes of partials (or parameters) sent by this rank to collectives (the
+    // send side only: with sparse reduction, each rank receives the values of
+    // all ranks), and updates, so far
+    long long bytes_sent;
+    int num_updates;
+#endif
+
     // layers
     Module** M;
 
     // z: data (inputs and outputs from modules) 
-    double** z;
+    real** z;
     // delta: partial derivatives with respect to module outputs z
-    double** delta;
+    real** delta;
+    // modules read and write these directly (their first and last data are 
+    // views of them), and z[0] and delta[num_modules] are the data passed to
+    // forward and backward, which must stay valid until partial_param; the 
+    // others are allocated by the first forward and backward after set_batch,
+    // so a network only evaluated with infer has none
+
+    // compiled inference plan (NULL until compiled; discarded when layers are
+    // added or the batch size changes)
+    InferencePlan* plan;
 
     // constructor and destructor
     Net(std::vector< std::vector <int> > config);
-    ~Net(); 
+    virtual ~Net(); 
 
-    // add layers to a module
+    // add layers to a module (rebuilds arena)
     void add_layers(int module_id, std::vector< std::vector <int> > config, double sigma);
 
-    // forward propagation on input
-    void forward(double* in, int train);
+    // lay out parameters and partials of all layers in the arena
+    void build_arena();
+
+    // set maximum batch size (reallocates module data)
+    void set_batch(int max_batch);
 
-    // backward propagation on output
-    void backward(double* out);
+    // forward propagation on a batch of inputs, stored [batch x inputs]
+    void forward(real* in, int train, int batch);
+
+    // compile inference plan (again, after layers have been replaced)
+    void compile();
+
+    // evaluate network on a batch of at most max_batch inputs with the
+    // inference plan (compiled if there is none); returns outputs, stored
+    // [batch x outputs], or NULL if batch is larger than max_batch
+    real* infer(real* in, int batch);
+
+    // backward propagation on a batch of outputs, stored [batch x outputs]
+    void backward(real* out, int batch);
 
     // clear accumulated partial derivaties 
     void clear_partial();
 
     // accumulate partial derivatives with respect to parameters
-    void partial_param();
+    void partial_param(int batch);
 
     // update parameters using accumulated partial derivatives
     void update_param(double lr, int batch_size);
 
+    // notify layers that parameters have been modified
+    void param_changed();
+
+    // make network with the same modules and layers that shares the parameters 
+    // of this network (partial derivatives and layer data are its own)
+    Net* replicate();
+
+    // add partial derivatives accumulated in replica N
+    void add_partial(Net* N);
+
     // print properties
     void properties();
 
+    // save configuration and parameters to a checkpoint file
+    // the file is a header, the configuration of modules and layers, and the 
+    // parameter arena as is, starting at a multiple of CHECKPOINT_ALIGN; of 
+    // the state of training, only the number of updates is saved (not the 
+    // residuals of sparse reduction, or the parameters of other ranks under
+    // local SGD)
+    // returns 0, or ERROR_CHECKPOINT_FILE
+    int save(const char* filename);
+
+    // load parameters from a checkpoint saved by a network of the same 
+    // configuration; with map, the parameter arena is mapped from the file
+    // (copy on write) instead of read, so nothing is copied until it is 
+    // modified; call before replicating the network, and after setting 
+    // sparsity and local steps (it warns that their state was not saved)
+    // returns 0, or ERROR_CHECKPOINT_FILE, _FORMAT or _CONFIG
+    int load(const char* filename, int map);
+
 #ifdef USE_MPI
     // sync paramaters of all ranks in all layers to rank 0
     void sync();
+
+    // set number of values per gradient bucket
+    void set_bucket_size(int bucket_size);
+
+    // turn hierarchical reduction on or off (ranks_per_node = 0: real nodes)
+    void set_hierarchical(int hierarchical, int ranks_per_node);
+
+    // sum partial derivatives over all ranks
+    void allreduce_partial();
+
+    // turn overlap of reduction with backward propagation on or off
+    virtual void set_overlap(int overlap);
+
+    // set fraction of partials sent by sparse reduction (0: dense reduction)
+    // sparse reduction is not overlapped with backward propagation, and falls
+    // back to dense reduction if what each rank gathers is no smaller
+    // call after all layers have been added
+    void set_sparsity(double sparsity);
+
+    // sum largest partials of all ranks, keep the rest for the next update
+    void sparse_allreduce_partial();
+
+    // set number of updates between averaging of parameters (0: reduce partials)
+    // call after all layers have been added
+    void set_local_steps(int local_steps);
+
+    // start averaging parameters over all ranks
+    void start_average();
+
+    // wait for averaging started, and apply it to parameters (the caller 
+    // notifies layers of the change)
+    void finish_average();
+
+    // layer partials are complete: launch reduction of any buckets now complete
+    virtual void partial_ready(Layer* L);
+
+    // launch reduction of all remaining buckets
+    void start_allreduce();
+
+    // wait for reduction of all buckets
+    void finish_allreduce();
 #endif
 
 };
 
+// copy n byte inputs into x, scaled by INPUT_SCALE
+void scale_input(int n, const uint8_t* in, real* x);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "plan.h"
+#include "net.h"
+#include "vmath.h"
+#include <iostream>
+#include <algorithm>
+#include <stdlib.h>
+
+// softmax on outputs of batch samples of size n, in place
+static void softmax_rows(real* x, int n, int batch) {
+  for (int b = 0; b < batch; b++) {
+    softmax(n, x + b*n, x + b*n);
+  }
+}
+
+// compile plan
+InferencePlan::InferencePlan(Net* net) : 
+    num_layers(0), max_batch(net->max_batch), scratch_size(0), data_bytes(0) {
+  // data of net and modules (other than views of each other and of callers)
+  for (int m = 0; m < net->num_modules; m++) {
+    data_bytes += 2*net->module_sizes[m+1];
+    Module* M = net->M[m];
+    for (int i = 1; i < M->num_layers; i++) {
+      data_bytes += 2*M->layer_sizes[i];
+    }
+  }
+  data_bytes *= max_batch*sizeof(real);
+
+  // fuse layers into steps
+  for (int m = 0; m < net->num_modules; m++) {
+    Module* M = net->M[m];
+    for (int i = 0; i < M->num_layers; i++) {
+      Layer* L = M->L[i];
+      int type = M->layer_types[i];
+      num_layers++;
+      PlanStep* last = steps.empty() ? NULL : &steps.back();
+      // dropout is the identity in evaluation
+      if (type == DROPOUT) continue;
+      // activations are applied to the output of the step before them, unless
+      // it is already pooled or normalized
+      if (type == RELU || type == SIG || type == SOFTMAX) {
+        if (last == NULL || last->pool != NULL || last->softmax ||
+            (type != SOFTMAX && last->activation != 0)) {
+          PlanStep s = { 0, NULL, ACT_NONE, 0, NULL, 0, L->inputs, L->inputs, L->outputs, -1 };
+          steps.push_back(s);
+          last = &steps.back();
+        }
+        if (type == SOFTMAX) last->softmax = 1;
+        else last->activation = (type == RELU) ? ACT_RELU : ACT_SIGMOID;
+        continue;
+      }
+      // pool the output of a convolution in chunks of samples that fit in cache
+      if (type == MAXPOOL && last != NULL && last->type == CONV && 
+          last->pool == NULL && !last->softmax) {
+        last->pool = L;
+        last->outputs = L->outputs;
+        last->chunk = PLAN_CHUNK_BYTES/(last->mid*sizeof(real));
+        last->chunk = std::max(1, std::min(last->chunk, max_batch));
+        scratch_size = std::max(scratch_size, last->chunk*last->mid);
+        continue;
+      }
+      // anything else is a step of its own
+      PlanStep s = { type, L, ACT_NONE, 0, NULL, 0, L->inputs, L->outputs, L->outputs, -1 };
+      steps.push_back(s);
+    }
+  }
+
+  // assign buffers: a step writes the buffer its input is not in; steps
+  // applied in place only need one if their input is that of the plan
+  int next = 0;
+  int on_input = 1;
+  buffer_size[0] = buffer_size[1] = 0;
+  for (size_t k = 0; k < steps.size(); k++) {
+    PlanStep& s = steps[k];
+    if (s.layer == NULL && !on_input) continue;
+    on_input = 0;
+    s.buffer = next;
+    buffer_size[next] = std::max(buffer_size[next], s.outputs);
+    next = 1 - next;
+  }
+  buffer[0] = new real[ max_batch*buffer_size[0] ];
+  buffer[1] = new real[ max_batch*buffer_size[1] ];
+  scratch = new real[ scratch_size ];
+  plan_bytes = (max_batch*(buffer_size[0] + buffer_size[1]) + scratch_size)*sizeof(real);
+}
+
+InferencePlan::~InferencePlan() {
+  delete[] buffer[0];
+  delete[] buffer[1];
+  delete[] scratch;
+}
+
+// evaluate network on batch of inputs
+real* InferencePlan::forward(real* in, int batch) {
+  real* x = in;
+  for (size_t k = 0; k < steps.size(); k++) {
+    const PlanStep& s = steps[k];
+    real* y = (s.buffer >= 0) ? buffer[s.buffer] : x;
+    if (s.layer == NULL) {
+      // epilogue only: in place, unless that would overwrite the input
+      if (y != x) std::copy(x, x + batch*s.inputs, y);
+      vactivate(s.activation, batch*s.outputs, y);
+    }
+    else if (s.pool != NULL) {
+      // layer output of each chunk goes to scratch, and only pooled output to y
+      s.layer->train = 0;
+      s.pool->train = 0;
+      for (int b = 0; b < batch; b += s.chunk) {
+        int n = std::min(s.chunk, batch - b);
+        s.layer->forward_fused(x + b*s.inputs, scratch, n, s.activation);
+        s.pool->forward(scratch, y + b*s.outputs, n);
+      }
+    }
+    else {
+      s.layer->train = 0;
+      s.layer->forward_fused(x, y, batch, s.activation);
+    }
+    if (s.softmax) softmax_rows(y, s.outputs, batch);
+    x = y;
+  }
+  return x;
+}
+
+// print steps
+void InferencePlan::properties() {
+  std::cout << "Inference plan: " << steps.size() << " steps for " << num_layers << " layers" << std::endl;
+  for (size_t k = 0; k < steps.size(); k++) {
+    const PlanStep& s = steps[k];
+    switch (s.type) {
+      case LINEAR:  std::cout << "  Linear"; break;
+      case CONV:    std::cout << "  Conv"; break;
+      case MAXPOOL: std::cout << "  Maxpool"; break;
+      default:      std::cout << "  (in place)"; break;
+    }
+    if (s.activation == ACT_RELU) std::cout << " + ReLU";
+    if (s.activation == ACT_SIGMOID) std::cout << " + Sigmoid";
+    if (s.softmax) std::cout << " + Softmax";
+    if (s.pool != NULL) std::cout << " + Maxpool";
+    std::cout << " (" << s.inputs << " -> " << s.outputs << ")";
+    if (s.pool != NULL) std::cout << ", " << s.chunk << " samples at a time";
+    std::cout << std::endl;
+  }
+  std::cout << "  data: " << plan_bytes/1024 << " KB in " << (buffer_size[1] > 0 ? 2 : 1) 
+    << " buffers (" << data_bytes/1024 << " KB for training)" << std::endl;
+}
@@ -0,0 +1,89 @@
+// compiled inference plan
+//
+// compile walks the layers of all modules of a network once, and fuses
+// chains that evaluation runs as separate layers, each a full pass through
+// memory, into single steps:
+//   Linear -> activation (-> Softmax):  the activation is applied by gemm as 
+//     it stores each tile of the output (see Layer::forward_fused); softmax 
+//     is applied to each output row after
+//   Conv -> activation (-> Maxpool):  the activation is applied as each tile
+//     or plane of the output is stored, and with Maxpool the batch is run in
+//     chunks of samples whose convolution output (about PLAN_CHUNK_BYTES) is 
+//     still in cache when it is pooled; only the pooled output is stored
+//   Dropout:  left out (identity in evaluation)
+// memory: the output of a step is live only until the next step has read it,
+// so two buffers, written alternately, hold all of them; each is sized for 
+// the largest output assigned to it, and steps applied in place need none
+// the plan does not touch the data z and delta of modules (which are then 
+// never allocated); layers are used as they are, so the plan follows updates
+// of their parameters, but must be compiled again when layers are added or 
+// replaced
+
+#include <vector>
+
+#include "layer.h"
+
+#ifndef _PLAN
+#define _PLAN
+
+// bytes of convolution output computed at a time by a Conv -> Maxpool step
+#define PLAN_CHUNK_BYTES (1 << 19)
+
+class Net;
+
+// one fused step
+struct PlanStep {
+  // type of layer (0 if none)
+  int type;
+  // layer computed by step (NULL: epilogue only, applied in place)
+  Layer* layer;
+  // activation applied to output of layer (ACT_NONE, ACT_RELU or 
+  // ACT_SIGMOID), then softmax
+  int activation;
+  int softmax;
+  // max pool applied to the result (NULL if none), and number of samples 
+  // run through layer and pool at a time
+  Layer* pool;
+  int chunk;
+  // inputs, outputs of layer (before pooling), and outputs of step
+  int inputs;
+  int mid;
+  int outputs;
+  // buffer written (-1: applied in place to output of step before)
+  int buffer;
+};
+
+class InferencePlan {
+  public:
+    // steps, and number of layers they replace
+    std::vector<PlanStep> steps;
+    int num_layers;
+
+    // maximum number of samples in a batch
+    int max_batch;
+
+    // buffers alternating as input and output of steps, and their sizes 
+    // (values per sample), and output of a chunk of samples before pooling
+    real* buffer[2];
+    int buffer_size[2];
+    real* scratch;
+    int scratch_size;
+
+    // bytes of memory for data used by the plan, and of data z and delta of 
+    // net and modules (as allocated for training)
+    size_t plan_bytes;
+    size_t data_bytes;
+
+    // compile plan for network
+    InferencePlan(Net* net);
+    ~InferencePlan();
+
+    // evaluate network on batch of inputs [batch x inputs] (batch at most
+    // max_batch); returns outputs [batch x outputs]
+    real* forward(real* in, int batch);
+
+    // print steps and memory footprint
+    void properties();
+};
+
+#endif
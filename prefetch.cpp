@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <new>
+#include <chrono>
+
+#include "prefetch.h"
+#include "net.h"
+
+// time in seconds
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// constructor and destructor
+Prefetcher::Prefetcher(int max_batch, int ins) : 
+      max_batch(max_batch), ins(ins), produced(0), consumed(0), stopped(0), wait_time(0) {
+  for (int s = 0; s < PREFETCH_SLOTS; s++) {
+    if (posix_memalign((void**) &in[s], 64, sizeof(real)*max_batch*ins) != 0) {
+      throw std::bad_alloc();
+    }
+    labels[s] = new unsigned int[max_batch];
+    count[s] = 0;
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  finish();
+  for (int s = 0; s < PREFETCH_SLOTS; s++) {
+    free(in[s]);
+    delete[] labels[s];
+  }
+}
+
+// start producer thread
+void Prefetcher::start(const uint8_t* data, const unsigned int* labels, 
+    const int* index, const int* first, int num_batches) {
+  finish();
+  produced.store(0);
+  consumed.store(0);
+  stopped.store(0);
+  wait_time = 0;
+  producer = std::thread(&Prefetcher::produce, this, data, labels, index, first, num_batches);
+}
+
+// producer: gather each batch into the next slot, once the consumer has
+// released the batch that was there
+void Prefetcher::produce(const uint8_t* data, const unsigned int* labels, 
+    const int* index, const int* first, int num_batches) {
+  for (int b = 0; b < num_batches; b++) {
+    while (b - consumed.load(std::memory_order_acquire) >= PREFETCH_SLOTS) {
+      if (stopped.load(std::memory_order_relaxed)) return;
+      std::this_thread::yield();
+    }
+    int s = b % PREFETCH_SLOTS;
+    count[s] = first[b+1] - first[b];
+    for (int i = 0; i < count[s]; i++) {
+      int k = index[ first[b] + i ];
+      scale_input(ins, data + (size_t) k*ins, in[s] + i*ins);
+      this->labels[s][i] = labels[k];
+    }
+    produced.store(b + 1, std::memory_order_release);
+  }
+}
+
+// wait for next batch
+int Prefetcher::next() {
+  int b = consumed.load(std::memory_order_relaxed);
+  if (produced.load(std::memory_order_acquire) <= b) {
+    double start = now();
+    while (produced.load(std::memory_order_acquire) <= b) {
+      std::this_thread::yield();
+    }
+    wait_time += now() - start;
+  }
+  return b % PREFETCH_SLOTS;
+}
+
+// release slot
+void Prefetcher::release() {
+  consumed.fetch_add(1, std::memory_order_release);
+}
+
+// wait for producer
+void Prefetcher::finish() {
+  stopped.store(1);
+  if (producer.joinable()) producer.join();
+}
@@ -0,0 +1,67 @@
+// background gathering of training batches
+//
+// a producer thread gathers the samples of each batch, in the order given,
+// from the data set (bytes) into a contiguous staging buffer of reals, and
+// hands the buffers to the training loop through a ring of slots; with one
+// producer and one consumer, the ring only needs two counters (batches 
+// gathered and batches consumed), each written by one side
+
+#ifndef _PREFETCH
+#define _PREFETCH
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+
+#include "real.h"
+
+// number of batches the ring holds
+#define PREFETCH_SLOTS 3
+
+class Prefetcher {
+  public:
+    // maximum number of samples in a batch, and inputs per sample
+    int max_batch;
+    int ins;
+
+    // staging buffers of each slot: inputs [max_batch x ins] (64-byte aligned)
+    // and labels, and number of samples in the batch
+    real* in[PREFETCH_SLOTS];
+    unsigned int* labels[PREFETCH_SLOTS];
+    int count[PREFETCH_SLOTS];
+
+    // batches gathered, and batches consumed
+    std::atomic<int> produced;
+    std::atomic<int> consumed;
+    // set to make producer stop early
+    std::atomic<int> stopped;
+
+    // time the consumer has spent waiting for batches
+    double wait_time;
+
+    // constructor and destructor
+    Prefetcher(int max_batch, int ins);
+    ~Prefetcher();
+
+    // start gathering num_batches batches; batch b holds the samples 
+    // index[first[b]] .. index[first[b+1]-1] of data (arrays must stay valid 
+    // until finish)
+    void start(const uint8_t* data, const unsigned int* labels, 
+        const int* index, const int* first, int num_batches);
+
+    // wait for next batch, and return its slot
+    int next();
+
+    // release slot of batch returned by next
+    void release();
+
+    // wait for producer to finish (stopping it, if batches are left unconsumed)
+    void finish();
+
+  private:
+    std::thread producer;
+    void produce(const uint8_t* data, const unsigned int* labels, 
+        const int* index, const int* first, int num_batches);
+};
+
+#endif
@@ -0,0 +1,491 @@
+// post-training int8 quantization for inference
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <vector>
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__) && defined(__AVX512VL__) && defined(__AVX512DQ__)
+  #include <immintrin.h>
+  #define QUANT_AVX512
+#endif
+
+#include "quantize.h"
+#include "im2col.h"
+#include "vmath.h"
+
+//
+// int8 matrix multiply
+//
+// Y (M x N) = W (M x K) * X (K x N), with W int8 stored row-major, and X uint8
+// packed in blocks of 16 columns: block[k/4][j][k%4] (64 bytes per 4 values of k),
+// so that one 512-bit load holds 4 consecutive k for 16 columns, as consumed by
+// the VNNI dot product instruction. K is padded to a multiple of 4, rows of W
+// to a multiple of QMR, and columns of X to a multiple of QNR
+//
+
+// rows and columns of the micro-kernel tile
+#define QMR 8
+#define QNR 32
+
+// int32 results are turned into real outputs as they are stored:
+//   y[i*rs + j*cs] = (acc - zero*wsum[i]) * xscale*wscale[i] + bias[i*brs + j*bcs]
+struct QOutput {
+  real* y;
+  int rs, cs;
+  const real* bias;
+  int brs, bcs;
+  const int32_t* wsum;
+  int zero;
+  const float* wscale;
+  float xscale;
+  // activation applied as outputs are stored
+  int act;
+};
+
+// tile (QMR x QNR) = rows of w times a pair of column blocks of x
+#ifdef QUANT_AVX512
+static inline void qkernel(int K4, const int8_t* w, int ldw, const uint8_t* x, int32_t* tile) {
+  __m512i acc[QMR][2];
+#pragma GCC unroll 8
+  for (int i = 0; i < QMR; i++) {
+    acc[i][0] = _mm512_setzero_si512();
+    acc[i][1] = _mm512_setzero_si512();
+  }
+  const uint8_t* x1 = x + K4*64;
+  for (int k4 = 0; k4 < K4; k4++) {
+    __m512i a0 = _mm512_loadu_si512(x + k4*64);
+    __m512i a1 = _mm512_loadu_si512(x1 + k4*64);
+#pragma GCC unroll 8
+    for (int i = 0; i < QMR; i++) {
+      int32_t wi;
+      memcpy(&wi, w + i*ldw + 4*k4, sizeof(wi));
+      __m512i b = _mm512_set1_epi32(wi);
+      acc[i][0] = _mm512_dpbusd_epi32(acc[i][0], a0, b);
+      acc[i][1] = _mm512_dpbusd_epi32(acc[i][1], a1, b);
+    }
+  }
+#pragma GCC unroll 8
+  for (int i = 0; i < QMR; i++) {
+    _mm512_storeu_si512(tile + i*QNR,      acc[i][0]);
+    _mm512_storeu_si512(tile + i*QNR + 16, acc[i][1]);
+  }
+}
+#else
+static inline void qkernel(int K4, const int8_t* w, int ldw, const uint8_t* x, int32_t* tile) {
+  std::fill(tile, tile + QMR*QNR, 0);
+  for (int k4 = 0; k4 < K4; k4++) {
+    for (int i = 0; i < QMR; i++) {
+      const int8_t* wi = w + i*ldw + 4*k4;
+      int32_t* ti = tile + i*QNR;
+      for (int jb = 0; jb < QNR/16; jb++) {
+        const uint8_t* xj = x + (jb*K4 + k4)*64;
+        for (int j = 0; j < 16; j++) {
+          ti[jb*16 + j] += wi[0]*xj[4*j] + wi[1]*xj[4*j+1] + wi[2]*xj[4*j+2] + wi[3]*xj[4*j+3];
+        }
+      }
+    }
+  }
+}
+#endif
+
+// y[j] = (t[j] - corr)*s + b[j] for one contiguous row of n <= QNR outputs
+static inline void qstore_row(int n, const int32_t* t, int32_t corr, float s, const real* b, real* y) {
+#ifdef QUANT_AVX512
+  __m512i vc = _mm512_set1_epi32(corr);
+  __m512 vs = _mm512_set1_ps(s);
+  for (int j = 0; j < n; j += 16) {
+    __mmask16 k = (n - j >= 16) ? 0xffff : (__mmask16) ((1u << (n - j)) - 1);
+    __m512 v = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_loadu_si512(t + j), vc)), vs);
+  #ifdef USE_FLOAT
+    _mm512_mask_storeu_ps(y + j, k, _mm512_add_ps(v, _mm512_maskz_loadu_ps(k, b + j)));
+  #else
+    __mmask8 k0 = (__mmask8) k, k1 = (__mmask8) (k >> 8);
+    __m512d v0 = _mm512_cvtps_pd(_mm512_castps512_ps256(v));
+    __m512d v1 = _mm512_cvtps_pd(_mm512_extractf32x8_ps(v, 1));
+    _mm512_mask_storeu_pd(y + j,     k0, _mm512_add_pd(v0, _mm512_maskz_loadu_pd(k0, b + j)));
+    _mm512_mask_storeu_pd(y + j + 8, k1, _mm512_add_pd(v1, _mm512_maskz_loadu_pd(k1, b + j + 8)));
+  #endif
+  }
+#else
+  for (int j = 0; j < n; j++) {
+    y[j] = (t[j] - corr)*s + b[j];
+  }
+#endif
+}
+
+// store m x n corner of tile at (i0, j0) of output
+static inline void qstore(const int32_t* tile, int i0, int j0, int m, int n, const QOutput& o) {
+  for (int i = 0; i < m; i++) {
+    int r = i0 + i;
+    int32_t corr = o.zero*o.wsum[r];
+    float s = o.xscale*o.wscale[r];
+    const int32_t* t = tile + i*QNR;
+    real* y = o.y + r*o.rs + j0*o.cs;
+    const real* b = o.bias + r*o.brs + j0*o.bcs;
+    if (o.cs == 1 && o.bcs == 1) {
+      qstore_row(n, t, corr, s, b, y);
+      vactivate(o.act, n, y);
+    }
+    else {
+      real v[QNR];
+      for (int j = 0; j < n; j++) {
+        v[j] = (t[j] - corr)*s + b[j*o.bcs];
+      }
+      vactivate(o.act, n, v);
+      for (int j = 0; j < n; j++) {
+        y[j*o.cs] = v[j];
+      }
+    }
+  }
+}
+
+// int8 matrix multiply, with K4 = (padded K)/4
+static void qgemm(int M, int N, int K4, const int8_t* W, const uint8_t* X, const QOutput& o) {
+  int ldw = 4*K4;
+  int32_t tile[QMR*QNR];
+  for (int j0 = 0; j0 < N; j0 += QNR) {
+    const uint8_t* x = X + (j0/16)*K4*64;
+    for (int i0 = 0; i0 < M; i0 += QMR) {
+      qkernel(K4, W + i0*ldw, ldw, x, tile);
+      qstore(tile, i0, j0, std::min(QMR, M - i0), std::min(QNR, N - j0), o);
+    }
+  }
+}
+
+//
+// quantization helpers
+//
+
+// round up to multiple of r
+static inline int round_up(int x, int r) {
+  return (x + r - 1)/r*r;
+}
+
+// scale and zero point mapping [lo, hi] (widened to contain 0) onto 0 .. 255
+static void activation_scale(real lo, real hi, float& scale, int& zero) {
+  lo = std::min(lo, (real) 0);
+  hi = std::max(hi, (real) 0);
+  scale = (hi > lo) ? (hi - lo)/255 : 1;
+  zero = std::max(0, std::min(255, (int) std::lround(-lo/scale)));
+}
+
+// quantize activation
+static inline uint8_t quantize_u8(real x, float inv_scale, int zero) {
+  int q = (int) std::lrint(x*inv_scale) + zero;
+  return (uint8_t) std::max(0, std::min(255, q));
+}
+
+// quantize n activations
+static void quantize_row(int n, const real* x, float inv_scale, int zero, uint8_t* q) {
+  int i = 0;
+#ifdef QUANT_AVX512
+  #ifdef USE_FLOAT
+  __m512 vinv = _mm512_set1_ps(inv_scale);
+  __m512i vz = _mm512_set1_epi32(zero);
+  for (; i + 16 <= n; i += 16) {
+    __m512i v = _mm512_add_epi32(_mm512_cvtps_epi32(_mm512_mul_ps(_mm512_loadu_ps(x + i), vinv)), vz);
+    v = _mm512_max_epi32(v, _mm512_setzero_si512());
+    _mm_storeu_si128((__m128i*) (q + i), _mm512_cvtusepi32_epi8(v));
+  }
+  #else
+  __m512d vinv = _mm512_set1_pd(inv_scale);
+  __m256i vz = _mm256_set1_epi32(zero);
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_add_epi32(_mm512_cvtpd_epi32(_mm512_mul_pd(_mm512_loadu_pd(x + i), vinv)), vz);
+    v = _mm256_max_epi32(v, _mm256_setzero_si256());
+    _mm_storel_epi64((__m128i*) (q + i), _mm256_cvtusepi32_epi8(v));
+  }
+  #endif
+#endif
+  for (; i < n; i++) {
+    q[i] = quantize_u8(x[i], inv_scale, zero);
+  }
+}
+
+// pack columns j < n of X (K4*4 rows, row stride ld) into 16 column blocks
+// columns of the last block past n are left as they are
+static void pack_columns(const uint8_t* X, int K4, int n, int ld, uint8_t* packed) {
+  for (int j0 = 0; j0 < n; j0 += 16) {
+    uint8_t* blk = packed + (j0/16)*K4*64;
+    int nj = std::min(16, n - j0);
+    for (int k4 = 0; k4 < K4; k4++) {
+      const uint8_t* x = X + 4*k4*ld + j0;
+      uint8_t* dst = blk + k4*64;
+#ifdef QUANT_AVX512
+      if (nj == 16) {
+        // interleave 16 bytes from each of 4 rows
+        __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) x));
+        v = _mm512_or_si512(v, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (x + ld))), 8));
+        v = _mm512_or_si512(v, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (x + 2*ld))), 16));
+        v = _mm512_or_si512(v, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (x + 3*ld))), 24));
+        _mm512_storeu_si512(dst, v);
+        continue;
+      }
+#endif
+      for (int j = 0; j < nj; j++) {
+        for (int t = 0; t < 4; t++) {
+          dst[4*j + t] = x[t*ld + j];
+        }
+      }
+    }
+  }
+}
+
+// pack rows j < n of X (n x K4*4, row stride ld) as the columns of 16 column blocks
+// rows of the last block past n are left as they are
+static void pack_rows(const uint8_t* X, int K4, int n, int ld, uint8_t* packed) {
+  for (int j0 = 0; j0 < n; j0 += 16) {
+    uint8_t* blk = packed + (j0/16)*K4*64;
+    int nj = std::min(16, n - j0);
+    for (int k4 = 0; k4 < K4; k4++) {
+      uint8_t* dst = blk + k4*64;
+      for (int j = 0; j < nj; j++) {
+        memcpy(dst + 4*j, X + (j0 + j)*ld + 4*k4, 4);
+      }
+    }
+  }
+}
+
+// quantize rows of weights (rows x cols) symmetrically, one scale per row,
+// into wq (rows_pad x cols_pad, zero padded)
+static void quantize_weights(const real* w, int rows, int cols, int rows_pad, int cols_pad,
+    int8_t* wq, int32_t* wsum, float* wscale) {
+  std::fill(wq, wq + rows_pad*cols_pad, 0);
+  std::fill(wsum, wsum + rows_pad, 0);
+  std::fill(wscale, wscale + rows_pad, 1.0f);
+  for (int i = 0; i < rows; i++) {
+    const real* wi = w + i*cols;
+    real amax = 0;
+    for (int k = 0; k < cols; k++) {
+      amax = std::max(amax, std::fabs(wi[k]));
+    }
+    wscale[i] = (amax > 0) ? amax/127 : 1;
+    float inv = 1/wscale[i];
+    for (int k = 0; k < cols; k++) {
+      int q = std::max(-127, std::min(127, (int) std::lrint(wi[k]*inv)));
+      wq[i*cols_pad + k] = q;
+      wsum[i] += q;
+    }
+  }
+}
+
+//
+// int8 fully connected layer
+//
+
+// constructor
+QLinear::QLinear(Linear* L, real xmin, real xmax) : Layer(L->inputs, L->outputs), 
+      xq(NULL), xp(NULL) {
+  // no trainable parameters
+  param = NULL;
+  partial = NULL;
+
+  inputs_pad  = round_up(inputs, 4);
+  outputs_pad = round_up(outputs, QMR);
+  wq     = new int8_t[outputs_pad*inputs_pad];
+  wsum   = new int32_t[outputs_pad];
+  wscale = new float[outputs_pad];
+  bias   = new real[outputs];
+
+  // weights are first in param (outputs x inputs), then biases
+  quantize_weights(L->param, outputs, inputs, outputs_pad, inputs_pad, wq, wsum, wscale);
+  std::copy(L->param + L->num_weights, L->param + L->num_weights + outputs, bias);
+
+  activation_scale(xmin, xmax, xscale, xzero);
+  set_batch(max_batch);
+}
+
+// destructor
+QLinear::~QLinear() {
+  delete[] wq;
+  delete[] wsum;
+  delete[] wscale;
+  delete[] bias;
+  delete[] xq;
+  delete[] xp;
+}
+
+// set maximum batch size
+// padding (inputs past the last, samples past the batch) holds the zero point
+void QLinear::set_batch(int max_batch) {
+  this->max_batch = max_batch;
+  delete[] xq;
+  delete[] xp;
+  int n = round_up(max_batch, QNR)*inputs_pad;
+  xq = new uint8_t[n];
+  xp = new uint8_t[n];
+  std::fill(xq, xq + n, (uint8_t) xzero);
+  std::fill(xp, xp + n, (uint8_t) xzero);
+}
+
+// print properties
+void QLinear::properties() {
+  std::cout << "Linear layer (int8): ";
+  std::cout << inputs << " inputs, ";
+  std::cout << outputs << " outputs" << std::endl;
+}
+
+// forward propagation
+// quantized inputs form the columns of X, one per sample, so out^T = W * X
+void QLinear::forward(real* in, real* out, int batch) {
+  forward_fused(in, out, batch, ACT_NONE);
+}
+
+// forward propagation, with activation applied as the outputs are stored
+void QLinear::forward_fused(real* in, real* out, int batch, int act) {
+  float inv = 1/xscale;
+  for (int b = 0; b < batch; b++) {
+    quantize_row(inputs, in + b*inputs, inv, xzero, xq + b*inputs_pad);
+  }
+  pack_rows(xq, inputs_pad/4, batch, inputs_pad, xp);
+  QOutput o = { out, 1, outputs, bias, 1, 0, wsum, xzero, wscale, xscale, act };
+  qgemm(outputs, batch, inputs_pad/4, wq, xp, o);
+}
+
+// inference only
+void QLinear::backward(real* in, real* out, real* delta, int batch) {};
+
+//
+// int8 convolutional layer
+//
+
+// constructor
+QConv::QConv(Conv* L, real xmin, real xmax) : Layer(L->inputs, L->outputs),
+      input_c(L->input_c), input_m(L->input_m), input_n(L->input_n),
+      ker_m(L->ker_m), ker_n(L->ker_n),
+      stride_m(L->stride_m), stride_n(L->stride_n),
+      output_c(L->output_c), output_m(L->output_m), output_n(L->output_n) {
+  // no trainable parameters
+  param = NULL;
+  partial = NULL;
+
+  K = L->num_weights/output_c;
+  K_pad = round_up(K, 4);
+  output_c_pad = round_up(output_c, QMR);
+  wq     = new int8_t[output_c_pad*K_pad];
+  wsum   = new int32_t[output_c_pad];
+  wscale = new float[output_c_pad];
+  bias   = new real[outputs];
+
+  // kernel for each output channel is one row (K = input_c x kernel rows x kernel columns),
+  // biases follow (one per output)
+  quantize_weights(L->param, output_c, K, output_c_pad, K_pad, wq, wsum, wscale);
+  std::copy(L->param + L->num_weights, L->param + L->num_weights + outputs, bias);
+
+  activation_scale(xmin, xmax, xscale, xzero);
+
+  // workspace for one sample; rows of col past K and columns of xp past the 
+  // last output pixel hold the zero point
+  int P = output_m*output_n;
+  xq  = new uint8_t[inputs];
+  col = new uint8_t[K_pad*P];
+  xp  = new uint8_t[round_up(P, QNR)*K_pad];
+  std::fill(col, col + K_pad*P, (uint8_t) xzero);
+  std::fill(xp, xp + round_up(P, QNR)*K_pad, (uint8_t) xzero);
+}
+
+// destructor
+QConv::~QConv() {
+  delete[] wq;
+  delete[] wsum;
+  delete[] wscale;
+  delete[] bias;
+  delete[] xq;
+  delete[] col;
+  delete[] xp;
+}
+
+// print properties
+void QConv::properties() {
+  std::cout << "Convolutional layer (int8): ";
+  std::cout << input_c << "x" << input_m << "x" << input_n << " inputs, ";
+  std::cout << output_c << "x" << output_m << "x" << output_n << " outputs, ";
+  std::cout << 2*ker_m+1 << "x" << 2*ker_n+1 << " kernel" << std::endl;
+}
+
+// forward propagation
+// input is quantized once, lowered with im2col (one column per output pixel)
+// and packed, so that each output channel is a row of out = W * col
+void QConv::forward(real* in, real* out, int batch) {
+  forward_fused(in, out, batch, ACT_NONE);
+}
+
+// forward propagation, with activation applied as the outputs are stored
+void QConv::forward_fused(real* in, real* out, int batch, int act) {
+  int P = output_m*output_n;
+  float inv = 1/xscale;
+  for (int b = 0; b < batch; b++) {
+    quantize_row(inputs, in + b*inputs, inv, xzero, xq);
+    im2col(xq, input_c, input_m, input_n, ker_m, ker_n,
+        stride_m, stride_n, output_m, output_n, (uint8_t) xzero, col);
+    pack_columns(col, K_pad/4, P, P, xp);
+    QOutput o = { out + b*outputs, P, 1, bias, P, 1, wsum, xzero, wscale, xscale, act };
+    qgemm(output_c, P, K_pad/4, wq, xp, o);
+  }
+}
+
+// inference only
+void QConv::backward(real* in, real* out, real* delta, int batch) {};
+
+//
+// calibration and quantization of network
+//
+
+int quantize_net(Net& net, int cnt, const uint8_t* data) {
+  // range of inputs of each layer in each module
+  std::vector< std::vector<real> > lo(net.num_modules), hi(net.num_modules);
+  for (int m = 0; m < net.num_modules; m++) {
+    lo[m].assign(net.M[m]->num_layers, 0);
+    hi[m].assign(net.M[m]->num_layers, 0);
+  }
+
+  // run calibration samples through the network, one batch at a time
+  int ins = net.module_sizes[0];
+  real* in = new real[ net.max_batch*ins ];
+  for (int bs = 0; bs < cnt; bs += net.max_batch) {
+    int batch = std::min(net.max_batch, cnt - bs);
+    for (int b = 0; b < batch; b++) {
+      scale_input(ins, data + (size_t) (bs+b)*ins, in + b*ins);
+    }
+    net.forward(in, 0, batch);
+    for (int m = 0; m < net.num_modules; m++) {
+      Module* M = net.M[m];
+      for (int i = 0; i < M->num_layers; i++) {
+        if (M->layer_types[i] != LINEAR && M->layer_types[i] != CONV) continue;
+        const real* z = M->z[i];
+        for (int k = 0; k < batch*M->layer_sizes[i]; k++) {
+          lo[m][i] = std::min(lo[m][i], z[k]);
+          hi[m][i] = std::max(hi[m][i], z[k]);
+        }
+      }
+    }
+  }
+  delete[] in;
+
+  // replace layers
+  int count = 0;
+  for (int m = 0; m < net.num_modules; m++) {
+    Module* M = net.M[m];
+    for (int i = 0; i < M->num_layers; i++) {
+      Layer* Q;
+      if (M->layer_types[i] == LINEAR) {
+        Q = new QLinear((Linear*) M->L[i], lo[m][i], hi[m][i]);
+      }
+      else if (M->layer_types[i] == CONV) {
+        Q = new QConv((Conv*) M->L[i], lo[m][i], hi[m][i]);
+      }
+      else {
+        continue;
+      }
+      Q->set_batch(M->max_batch);
+      delete M->L[i];
+      M->L[i] = Q;
+      count++;
+    }
+  }
+  // plan must use the new layers
+  net.compile();
+  return count;
+}
@@ -0,0 +1,112 @@
+// post-training int8 quantization for inference
+//
+// quantize_net calibrates the range of the inputs of every Linear and Conv
+// layer on a sample of data, then replaces those layers by int8 versions:
+//   weights:     symmetric int8, one scale per output neuron / output channel
+//   activations: asymmetric uint8 (scale and zero point per layer), quantized
+//                on entry to the layer
+// products are accumulated in int32 (AVX-512 VNNI when available), and the
+// zero point correction, scales and bias are applied in the same pass that
+// stores the int32 results, so layers still take and produce type real and
+// all other layers are unchanged
+// quantized layers are inference only: they have no parameters to train and
+// backward does nothing
+
+#ifndef _QUANTIZE
+#define _QUANTIZE
+
+#include <stdint.h>
+
+#include "net.h"
+
+//
+// int8 fully connected layer
+//
+
+class QLinear : public Layer {
+  public:
+    // inputs padded to a multiple of 4, outputs padded to a multiple of the kernel rows
+    int inputs_pad, outputs_pad;
+
+    // quantized weights (outputs_pad x inputs_pad), their row sums, and scales
+    int8_t* wq;
+    int32_t* wsum;
+    float* wscale;
+    real* bias;
+
+    // input quantization: real x maps to round(x/xscale) + xzero
+    float xscale;
+    int xzero;
+
+    // quantized inputs (max_batch x inputs_pad), and the same packed for the int8 kernel
+    uint8_t* xq;
+    uint8_t* xp;
+
+    // constructor (from trained layer and calibrated input range) and destructor
+    QLinear(Linear* L, real xmin, real xmax);
+    ~QLinear();
+
+    // set maximum batch size (reallocates quantized inputs)
+    void set_batch(int max_batch);
+
+    // print properties
+    void properties();
+
+    // forward and backward propagation
+    void forward(real* in, real* out, int batch);
+    void forward_fused(real* in, real* out, int batch, int act);
+    void backward(real* in, real* out, real* delta, int batch);
+};
+
+//
+// int8 convolutional layer (lowered to an int8 matrix multiply per sample)
+//
+
+class QConv : public Layer {
+  public:
+    // dimensions of input, kernel, stride and output, as in Conv
+    int input_c, input_m, input_n;
+    int ker_m, ker_n;
+    int stride_m, stride_n;
+    int output_c, output_m, output_n;
+
+    // lowered kernel size (input_c*(2km+1)*(2kn+1)) padded to a multiple of 4
+    int K, K_pad;
+    // output channels padded to a multiple of the kernel rows
+    int output_c_pad;
+
+    // quantized weights (output_c_pad x K_pad), their row sums, and scales
+    int8_t* wq;
+    int32_t* wsum;
+    float* wscale;
+    real* bias;
+
+    // input quantization: real x maps to round(x/xscale) + xzero
+    float xscale;
+    int xzero;
+
+    // quantized input image, lowered input (K_pad x output_m*output_n), and
+    // lowered input packed for the int8 kernel
+    uint8_t* xq;
+    uint8_t* col;
+    uint8_t* xp;
+
+    // constructor (from trained layer and calibrated input range) and destructor
+    QConv(Conv* L, real xmin, real xmax);
+    ~QConv();
+
+    // print properties
+    void properties();
+
+    // forward and backward propagation
+    void forward(real* in, real* out, int batch);
+    void forward_fused(real* in, real* out, int batch, int act);
+    void backward(real* in, real* out, real* delta, int batch);
+};
+
+// calibrate input ranges of Linear and Conv layers on the first cnt samples of
+// data (stored as bytes, see INPUT_SCALE), and replace them in net by int8 layers
+// returns the number of layers quantized
+int quantize_net(Net& net, int cnt, const uint8_t* data);
+
+#endif
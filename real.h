@@ -0,0 +1,20 @@
+// floating point type used for network parameters and data
+// build with -DUSE_FLOAT for single precision (default is double precision)
+// -DUSE_BF16 additionally stores Linear weights as bfloat16 (implies USE_FLOAT)
+
+#ifndef _REAL
+#define _REAL
+
+#if defined(USE_BF16) && !defined(USE_FLOAT)
+  #define USE_FLOAT
+#endif
+
+#ifdef USE_FLOAT
+  typedef float real;
+  #define MPI_REAL_T MPI_FLOAT
+#else
+  typedef double real;
+  #define MPI_REAL_T MPI_DOUBLE
+#endif
+
+#endif
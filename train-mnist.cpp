@@ -5,6 +5,11 @@
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <chrono>
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
 
 #ifdef USE_MPI
   #include "mpi.h"
@@ -13,6 +18,7 @@
 
 #include "classifier.h"
 #include "loadmnist.h"
+#include "quantize.h"
 
 // #define FASHION
 
@@ -33,15 +39,15 @@ int main(int argc, char* argv[]) {
   int numprocs, myid;
 
 #ifdef USE_MPI
-  // initialize MPI
-  int ierr;
-  ierr = MPI_Init(&argc, &argv);
+  // initialize MPI (only the main thread of each rank communicates)
+  int ierr, provided;
+  ierr = MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   if (ierr != 0) {
     std::cerr << " error in MPI_Init = " << ierr << std::endl;
     return 1;
   }
   whoami(numprocs, myid);
-  if (myid == 0) std::cout << "Number of MPI ranks: " << numprocs << std::endl << std::endl;
+  if (myid == 0) std::cout << "Number of MPI ranks: " << numprocs << std::endl;
 #else
   numprocs = 1;
   myid = 0;
@@ -54,36 +60,54 @@ int main(int argc, char* argv[]) {
   // loss and accuracy
   double train_acc, train_loss, test_acc, test_loss;
 
+  // after each epoch, evaluate loss and accuracy on the training data again, 
+  // rather than show those the output layer computed during the epoch (the 
+  // "epoch loss" and "epoch accuracy" columns, averaged over an epoch in 
+  // which the parameters changed)
+  int evaluate_train = 0;
+
   // timers
   double batch_time, loss_time, timer;
   double total_time = 0;
 
-  // arrays to be allocated for data and labels
+  // arrays to be allocated for data (images as bytes) and labels
+  // images are mapped from the files if map_data is set (and possible)
+  // with shard_data set, each rank only loads the samples it works on
+  int map_data = 1;
+  int shard_data = 1;
+  int shard = shard_data ? myid : 0;
+  int num_shards = shard_data ? numprocs : 1;
   // training
   unsigned int train_cnt;
-  double** train_data;
+  uint8_t* train_data;
   unsigned int* train_labels;
+  int train_mapped = map_data;
   // test
   unsigned int test_cnt;
-  double** test_data;
+  uint8_t* test_data;
   unsigned int* test_labels;
+  int test_mapped = map_data;
 
   // load training data
-  train_cnt = mnist_load(TRAIN_IMAGES, TRAIN_LABELS, train_data, train_labels);
+  train_cnt = mnist_load(TRAIN_IMAGES, TRAIN_LABELS, train_data, train_labels, train_mapped, 
+      shard, num_shards);
   if (train_cnt <= 0) {
     printf("An error occured loading training data: %d\n", train_cnt);
   } 
   else {
-    if (myid == 0) printf("training image count: %d\n", train_cnt);
+    if (myid == 0) printf("training image count: %d%s\n", train_cnt, 
+        num_shards > 1 ? " (shard of rank 0)" : "");
   }
 
   // load test data
-  test_cnt = mnist_load(TEST_IMAGES, TEST_LABELS, test_data, test_labels);
+  test_cnt = mnist_load(TEST_IMAGES, TEST_LABELS, test_data, test_labels, test_mapped, 
+      shard, num_shards);
   if (test_cnt <= 0) {
     printf("An error occured loading test data: %d\n", test_cnt);
   } 
   else {
-     if (myid == 0) printf("test image count: %d\n\n", test_cnt);
+     if (myid == 0) printf("test image count: %d%s\n\n", test_cnt, 
+        num_shards > 1 ? " (shard of rank 0)" : "");
   }
 
   //
@@ -96,11 +120,37 @@ int main(int argc, char* argv[]) {
   // learning rate
   double learning_rate;
 
+  // checkpoint: with save_checkpoint set, parameters are saved to it after 
+  // training (by rank 0), and with load_checkpoint set, training continues 
+  // from it (mapped) if it exists and was saved by the same network
+  const char* checkpoint = "train-mnist.ckpt";
+  int load_checkpoint = 0;
+  int save_checkpoint = 0;
+
   // network parameters
   int epochs = 10;
   int batch_size = 256;
   double weight_decay = 0;
 
+#ifdef USE_MPI
+  // number of gradient values reduced across ranks by each collective
+  int bucket_size = DEFAULT_BUCKET_SIZE;
+  // overlap reduction of gradients with backward propagation
+  int overlap = 1;
+  // reduce gradients within each node through shared memory, and across nodes 
+  // among node leaders only; ranks_per_node > 0 splits each machine into 
+  // simulated nodes of that many ranks (0: one node per machine)
+  int hierarchical = 1;
+  int ranks_per_node = 0;
+  // fraction of gradient values of each layer sent by each rank (largest in
+  // magnitude, the rest is carried over to the next batch); 0 sends all
+  double sparsity = 0;
+  // local SGD: each rank trains on its own shard with its own parameters, 
+  // which are averaged over ranks every local_steps batches (0: reduce 
+  // gradients every batch); averaging overlaps the next batch if overlap is on
+  int local_steps = 0;
+#endif
+
   // lots of network architectures to choose from!
 
   // // one layer linear
@@ -246,9 +296,43 @@ int main(int argc, char* argv[]) {
 
   // Classifier C(seq_config,sigma);
 
+  // each rank was given only its shard of the data
+  C.sharded = (num_shards > 1);
+
+  // size network data for the slice of each mini-batch handled by this rank
+  C.set_batch(batch_size/numprocs + batch_size%numprocs);
+
+#ifdef USE_MPI
+  C.set_bucket_size(bucket_size);
+  C.set_hierarchical(hierarchical, ranks_per_node);
+  C.set_overlap(overlap);
+  C.set_sparsity(sparsity);
+  C.set_local_steps(local_steps);
+#endif
+
+  // continue from checkpoint
+  if (load_checkpoint) {
+    auto start = std::chrono::steady_clock::now();
+    int error = C.load(checkpoint, 1);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (myid == 0) {
+      if (error == 0) std::cout << "Loaded checkpoint " << checkpoint << " in " << ms << " ms" << std::endl;
+      else if (error != ERROR_CHECKPOINT_FILE) std::cout << "Checkpoint " << checkpoint 
+          << " not used (error " << error << ")" << std::endl;
+    }
+  }
+
 #ifdef USE_MPI
   C.sync();
+  if (myid == 0 && hierarchical) std::cout << "Number of nodes: " << C.num_nodes << std::endl;
+#endif
+
+  // split each rank's slice of a mini-batch across worker threads
+  // (number of threads set by OMP_NUM_THREADS)
+#ifdef _OPENMP
+  C.set_threads(omp_get_max_threads());
 #endif
+  if (myid == 0) std::cout << "Number of training threads: " << C.num_threads << std::endl << std::endl;
 
   // print network properties
   if (myid == 0) {
@@ -256,6 +340,13 @@ int main(int argc, char* argv[]) {
     std::cout << std::endl;
   }
 
+  // compile inference plan used to evaluate the network
+  C.compile();
+  if (myid == 0) {
+    C.plan->properties();
+    std::cout << std::endl;
+  }
+
   //
   // run training epochs
   //
@@ -265,8 +356,8 @@ int main(int argc, char* argv[]) {
     std::cout 
       << std::left
       << std::setw(8)  << "epoch"
-      << std::setw(20) << "cross-entropy loss"
-      << std::setw(20) << "train accuracy"
+      << std::setw(20) << (evaluate_train ? "cross-entropy loss" : "epoch loss")
+      << std::setw(20) << (evaluate_train ? "train accuracy" : "epoch accuracy")
       << std::setw(20) << "test accuracy" 
       << std::setw(20) << "loss time"
       << std::setw(20) << "training time"
@@ -296,13 +387,24 @@ int main(int argc, char* argv[]) {
   // run training epochs
   for (int i = 1; i <= epochs; i++) {
 
+#ifdef USE_MPI
+    long long bytes_sent = C.bytes_sent;
+    int num_updates = C.num_updates;
+#endif
     batch_time = C.train_epoch(train_cnt, train_data, train_labels, 
           learning_rate, weight_decay, batch_size);
     total_time += batch_time;
 
-    loss_time  = C.compute_loss(train_cnt, train_data, train_labels);
-    train_acc = C.accuracy;
-    train_loss = C.loss;
+    if (evaluate_train) {
+      loss_time  = C.compute_loss(train_cnt, train_data, train_labels);
+      train_acc = C.accuracy;
+      train_loss = C.loss;
+    }
+    else {
+      loss_time = 0;
+      train_acc = C.train_accuracy;
+      train_loss = C.train_loss;
+    }
     loss_time += C.compute_loss(test_cnt, test_data, test_labels);
     total_time += loss_time;
 
@@ -319,6 +421,16 @@ int main(int argc, char* argv[]) {
         << std::setw(20) << batch_time
         << std::endl;
     }
+    if (myid == 0) {
+      std::cout << "        batch wait time: " << C.wait_time << std::endl;
+    }
+#ifdef USE_MPI
+    // gradient bytes sent by rank 0 per update (not counting those received)
+    if (myid == 0 && C.num_updates > num_updates) {
+      std::cout << "        gradient bytes sent per step: " 
+        << (C.bytes_sent - bytes_sent)/(C.num_updates - num_updates) << std::endl;
+    }
+#endif
   }
 
   // print total time
@@ -326,19 +438,35 @@ int main(int argc, char* argv[]) {
     std::cout << "Total time: " << total_time << std::endl;
   }
 
-  // unallocate training data
-  for (int i = 0; i < train_cnt; i++) {
-    delete[] train_data[i];
+  // save checkpoint
+  if (save_checkpoint && myid == 0) {
+    if (C.save(checkpoint) != 0) std::cout << "error saving checkpoint " << checkpoint << std::endl;
   }
-  delete[] train_data;
-  delete[] train_labels;
 
-  // unallocate test data
-  for (int i = 0; i < test_cnt; i++) {
-    delete[] test_data[i];
+  //
+  // int8 inference: calibrate on a sample of the training data, and compare
+  // test accuracy and evaluation time with the trained network
+  //
+
+  int calibration_cnt = (train_cnt < 1000) ? train_cnt : 1000;
+  loss_time = C.compute_loss(test_cnt, test_data, test_labels);
+  test_acc = C.accuracy;
+  int quantized = quantize_net(C, calibration_cnt, train_data);
+  double quant_time = C.compute_loss(test_cnt, test_data, test_labels);
+
+  if (myid == 0) {
+    std::cout << std::endl
+      << "int8 inference (" << quantized << " layers quantized, " 
+      << calibration_cnt << " calibration samples)" << std::endl
+      << "  test accuracy: " << C.accuracy << " (trained " << test_acc 
+      << ", delta " << C.accuracy - test_acc << ")" << std::endl
+      << "  test loss time: " << quant_time << " (trained " << loss_time 
+      << ", speedup " << loss_time/quant_time << ")" << std::endl;
   }
-  delete[] test_data;
-  delete[] test_labels;
+
+  // unallocate training and test data
+  mnist_free(train_data, train_labels, train_cnt, train_mapped);
+  mnist_free(test_data, test_labels, test_cnt, test_mapped);
 
 #ifdef USE_MPI
   // finalize MPI
@@ -0,0 +1,269 @@
+// vectorized exp, log, sigmoid and softmax
+//
+// exp(x) = 2^k exp(r) with k = round(x/ln2) and r = x - k ln2 (ln2 split into
+// a high part, exact when multiplied by k, and a low part), |r| <= ln2/2;
+// exp(r) is its Taylor polynomial, of degree 13 in double precision (remainder
+// below 1e-17 relative) and 7 in single (below 1e-8), evaluated by Horner's rule.
+// log(x) = e ln2 + log(m) with x = 2^e m, sqrt(1/2) <= m < sqrt(2); with
+// s = (m-1)/(m+1), |s| <= 0.172, log(m) = 2 atanh(s) = 2 (s + s^3/3 + s^5/5 + ...),
+// summed up to s^21 in double precision (remainder below 1e-18 relative) and
+// s^9 in single (below 3e-9).
+// The remainders are well below half an ulp, so the error is that of rounding
+// in the few operations of each; measured against libm it is at most 2 ulp.
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
+#include "vmath.h"
+
+//
+// vector abstraction (AVX-512, AVX2 + FMA, or scalar fallback) for type real
+// vscale2(p,k) is p*2^k, vgetexp(x) and vgetmant(x) are e and m in [1,2) with
+// x = 2^e m for positive normal x, vselect_gt(a,b,x,y) is (a > b) ? x : y
+//
+
+#if defined(__AVX512F__) && defined(USE_FLOAT)
+  #define VLEN 16
+  typedef __m512 vec;
+  #define vset1(x)      _mm512_set1_ps(x)
+  #define vload(p)      _mm512_loadu_ps(p)
+  #define vstore(p,v)   _mm512_storeu_ps(p,v)
+  #define vadd(a,b)     _mm512_add_ps(a,b)
+  #define vsub(a,b)     _mm512_sub_ps(a,b)
+  #define vmul(a,b)     _mm512_mul_ps(a,b)
+  #define vdiv(a,b)     _mm512_div_ps(a,b)
+  #define vfma(a,b,c)   _mm512_fmadd_ps(a,b,c)
+  #define vmax(a,b)     _mm512_max_ps(a,b)
+  #define vmin(a,b)     _mm512_min_ps(a,b)
+  #define vround(x)     _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vscale2(p,k)  _mm512_scalef_ps(p,k)
+  #define vgetexp(x)    _mm512_getexp_ps(x)
+  #define vgetmant(x)   _mm512_getmant_ps(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src)
+  #define vselect_gt(a,b,x,y) _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a,b,_CMP_GT_OQ), y, x)
+#elif defined(__AVX512F__)
+  #define VLEN 8
+  typedef __m512d vec;
+  #define vset1(x)      _mm512_set1_pd(x)
+  #define vload(p)      _mm512_loadu_pd(p)
+  #define vstore(p,v)   _mm512_storeu_pd(p,v)
+  #define vadd(a,b)     _mm512_add_pd(a,b)
+  #define vsub(a,b)     _mm512_sub_pd(a,b)
+  #define vmul(a,b)     _mm512_mul_pd(a,b)
+  #define vdiv(a,b)     _mm512_div_pd(a,b)
+  #define vfma(a,b,c)   _mm512_fmadd_pd(a,b,c)
+  #define vmax(a,b)     _mm512_max_pd(a,b)
+  #define vmin(a,b)     _mm512_min_pd(a,b)
+  #define vround(x)     _mm512_roundscale_pd(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vscale2(p,k)  _mm512_scalef_pd(p,k)
+  #define vgetexp(x)    _mm512_getexp_pd(x)
+  #define vgetmant(x)   _mm512_getmant_pd(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src)
+  #define vselect_gt(a,b,x,y) _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a,b,_CMP_GT_OQ), y, x)
+#elif defined(__AVX2__) && defined(__FMA__) && defined(USE_FLOAT)
+  #define VLEN 8
+  typedef __m256 vec;
+  #define vset1(x)      _mm256_set1_ps(x)
+  #define vload(p)      _mm256_loadu_ps(p)
+  #define vstore(p,v)   _mm256_storeu_ps(p,v)
+  #define vadd(a,b)     _mm256_add_ps(a,b)
+  #define vsub(a,b)     _mm256_sub_ps(a,b)
+  #define vmul(a,b)     _mm256_mul_ps(a,b)
+  #define vdiv(a,b)     _mm256_div_ps(a,b)
+  #define vfma(a,b,c)   _mm256_fmadd_ps(a,b,c)
+  #define vmax(a,b)     _mm256_max_ps(a,b)
+  #define vmin(a,b)     _mm256_min_ps(a,b)
+  #define vround(x)     _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vselect_gt(a,b,x,y) _mm256_blendv_ps(y, x, _mm256_cmp_ps(a,b,_CMP_GT_OQ))
+  static inline vec vscale2(vec p, vec k) {
+    __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127));
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(_mm256_slli_epi32(e, 23)));
+  }
+  static inline vec vgetexp(vec x) {
+    __m256i e = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+    return _mm256_cvtepi32_ps(_mm256_sub_epi32(e, _mm256_set1_epi32(127)));
+  }
+  static inline vec vgetmant(vec x) {
+    __m256i m = _mm256_and_si256(_mm256_castps_si256(x), _mm256_set1_epi32(0x007fffff));
+    return _mm256_castsi256_ps(_mm256_or_si256(m, _mm256_set1_epi32(0x3f800000)));
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  #define VLEN 4
+  typedef __m256d vec;
+  #define vset1(x)      _mm256_set1_pd(x)
+  #define vload(p)      _mm256_loadu_pd(p)
+  #define vstore(p,v)   _mm256_storeu_pd(p,v)
+  #define vadd(a,b)     _mm256_add_pd(a,b)
+  #define vsub(a,b)     _mm256_sub_pd(a,b)
+  #define vmul(a,b)     _mm256_mul_pd(a,b)
+  #define vdiv(a,b)     _mm256_div_pd(a,b)
+  #define vfma(a,b,c)   _mm256_fmadd_pd(a,b,c)
+  #define vmax(a,b)     _mm256_max_pd(a,b)
+  #define vmin(a,b)     _mm256_min_pd(a,b)
+  #define vround(x)     _mm256_round_pd(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vselect_gt(a,b,x,y) _mm256_blendv_pd(y, x, _mm256_cmp_pd(a,b,_CMP_GT_OQ))
+  static inline vec vscale2(vec p, vec k) {
+    __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k));
+    e = _mm256_add_epi64(e, _mm256_set1_epi64x(1023));
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(_mm256_slli_epi64(e, 52)));
+  }
+  static inline vec vgetexp(vec x) {
+    // biased exponent as the low bits of 2^52, converted by subtracting 2^52
+    const __m256i two52 = _mm256_set1_epi64x(0x4330000000000000LL);
+    __m256i e = _mm256_or_si256(_mm256_srli_epi64(_mm256_castpd_si256(x), 52), two52);
+    return _mm256_sub_pd(_mm256_castsi256_pd(e), _mm256_set1_pd(4503599627370496.0 + 1023));
+  }
+  static inline vec vgetmant(vec x) {
+    __m256i m = _mm256_and_si256(_mm256_castpd_si256(x), _mm256_set1_epi64x(0x000fffffffffffffLL));
+    return _mm256_castsi256_pd(_mm256_or_si256(m, _mm256_set1_epi64x(0x3ff0000000000000LL)));
+  }
+#else
+  #define VLEN 1
+  typedef real vec;
+  #define vset1(x)      ((real) (x))
+  #define vload(p)      (*(p))
+  #define vstore(p,v)   (*(p) = (v))
+  #define vadd(a,b)     ((a) + (b))
+  #define vsub(a,b)     ((a) - (b))
+  #define vmul(a,b)     ((a) * (b))
+  #define vdiv(a,b)     ((a) / (b))
+  #define vfma(a,b,c)   ((a)*(b) + (c))
+  #define vmax(a,b)     std::max(a,b)
+  #define vmin(a,b)     std::min(a,b)
+  #define vround(x)     std::nearbyint(x)
+  #define vscale2(p,k)  std::ldexp(p, (int) (k))
+  #define vgetexp(x)    ((real) std::ilogb(x))
+  #define vgetmant(x)   std::scalbn(x, -std::ilogb(x))
+  #define vselect_gt(a,b,x,y) (((a) > (b)) ? (x) : (y))
+#endif
+
+// constants: ln2 split into high part (with trailing zero bits, so k*LN2_HI is
+// exact) and low part, range of exp, and degrees of the polynomials
+#ifdef USE_FLOAT
+  #define LN2_HI   0.693359375f
+  #define LN2_LO   -2.12194440e-4f
+  #define EXP_LO   -87.0f
+  #define EXP_HI   88.0f
+  #define EXP_DEGREE 7
+  #define LOG_TERMS  5
+#else
+  #define LN2_HI   6.93147180369123816490e-01
+  #define LN2_LO   1.90821492927058770002e-10
+  #define EXP_LO   -708.0
+  #define EXP_HI   709.0
+  #define EXP_DEGREE 13
+  #define LOG_TERMS  11
+#endif
+#define LOG2E  1.44269504088896340736
+#define SQRT2  1.41421356237309504880
+
+// coefficients of exp (1/i!) and of log (1/(2i+1))
+static const double exp_coef[14] = {
+  1.0, 1.0, 0.5, 1.66666666666666666667e-01, 4.16666666666666666667e-02,
+  8.33333333333333333333e-03, 1.38888888888888888889e-03, 1.98412698412698412698e-04,
+  2.48015873015873015873e-05, 2.75573192239858906526e-06, 2.75573192239858906526e-07,
+  2.50521083854417187751e-08, 2.08767569878680989792e-09, 1.60590438368216145994e-10 };
+static const double log_coef[11] = {
+  1.0, 1.0/3, 1.0/5, 1.0/7, 1.0/9, 1.0/11, 1.0/13, 1.0/15, 1.0/17, 1.0/19, 1.0/21 };
+
+// exp of vector
+static inline vec exp_vec(vec x) {
+  x = vmin(vmax(x, vset1(EXP_LO)), vset1(EXP_HI));
+  vec k = vround(vmul(x, vset1(LOG2E)));
+  vec r = vfma(k, vset1(-LN2_HI), x);
+  r = vfma(k, vset1(-LN2_LO), r);
+  // Taylor polynomial
+  vec p = vset1((real) exp_coef[EXP_DEGREE]);
+  for (int i = EXP_DEGREE - 1; i >= 0; i--) {
+    p = vfma(p, r, vset1((real) exp_coef[i]));
+  }
+  return vscale2(p, k);
+}
+
+// log of vector
+static inline vec log_vec(vec x) {
+  x = vmax(x, vset1(std::numeric_limits<real>::min()));
+  vec e = vgetexp(x);
+  vec m = vgetmant(x);
+  // move m from [sqrt(2),2) to [sqrt(1/2),1)
+  e = vselect_gt(m, vset1(SQRT2), vadd(e, vset1(1)), e);
+  m = vselect_gt(m, vset1(SQRT2), vmul(m, vset1(0.5)), m);
+  vec s = vdiv(vsub(m, vset1(1)), vadd(m, vset1(1)));
+  vec z = vmul(s, s);
+  // series 1 + z/3 + z^2/5 + ...
+  vec p = vset1((real) log_coef[LOG_TERMS - 1]);
+  for (int i = LOG_TERMS - 2; i >= 0; i--) {
+    p = vfma(p, z, vset1((real) log_coef[i]));
+  }
+  vec lm = vmul(vadd(s, s), p);
+  return vfma(e, vset1(LN2_HI), vfma(e, vset1(LN2_LO), lm));
+}
+
+// sigmoid of vector
+static inline vec sigmoid_vec(vec x) {
+  vec one = vset1(1);
+  return vdiv(one, vadd(one, exp_vec(vsub(vset1(0), x))));
+}
+
+// apply f to n values, VLEN at a time; the last partial vector goes through a
+// buffer padded with pad
+template <typename F>
+static void apply(int n, const real* x, real* y, F f, real pad) {
+  int i = 0;
+  for (; i + VLEN <= n; i += VLEN) {
+    vstore(y + i, f(vload(x + i)));
+  }
+  if (i < n) {
+    real t[VLEN];
+    std::fill(t, t + VLEN, pad);
+    std::copy(x + i, x + n, t);
+    vstore(t, f(vload(t)));
+    std::copy(t, t + (n - i), y + i);
+  }
+}
+
+void vexp(int n, const real* x, real* y) {
+  apply(n, x, y, exp_vec, 0);
+}
+
+void vlog(int n, const real* x, real* y) {
+  apply(n, x, y, log_vec, 1);
+}
+
+void vsigmoid(int n, const real* x, real* y) {
+  apply(n, x, y, sigmoid_vec, 0);
+}
+
+void vactivate(int activation, int n, real* x) {
+  if (activation == ACT_RELU) {
+    for (int i = 0; i < n; i++) {
+      x[i] = (x[i] > 0) ? x[i] : 0;
+    }
+  }
+  else if (activation == ACT_SIGMOID) {
+    vsigmoid(n, x, x);
+  }
+}
+
+void softmax(int n, const real* x, real* y) {
+  real mx = x[0];
+  for (int i = 1; i < n; i++) {
+    mx = std::max(mx, x[i]);
+  }
+  // y = exp(x - max), summed
+  for (int i = 0; i < n; i++) {
+    y[i] = x[i] - mx;
+  }
+  vexp(n, y, y);
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) {
+    sum += y[i];
+  }
+  const real scale = 1.0/sum;
+  for (int i = 0; i < n; i++) {
+    y[i] *= scale;
+  }
+}
@@ -0,0 +1,35 @@
+// vectorized elementwise functions used by the activation layers and the loss
+// all take n values in x and write n values to y (x and y may be the same)
+
+#ifndef _VMATH
+#define _VMATH
+
+#include "real.h"
+
+// activations applied in place by vactivate, and by the epilogues of gemm 
+// and of layers that store their outputs with it
+#define ACT_NONE 0
+#define ACT_RELU 1
+#define ACT_SIGMOID 2
+
+// y = exp(x)
+// x is clamped to [-708, 709] in double precision ([-87, 88] in single), so
+// results are finite and normal; relative error within 2 ulp of libm exp
+void vexp(int n, const real* x, real* y);
+
+// y = log(x)
+// x is clamped below to the smallest normal number (so log(0) is about -708,
+// or -87 in single precision); absolute error within 2 ulp of libm log
+void vlog(int n, const real* x, real* y);
+
+// y = 1/(1 + exp(-x))
+void vsigmoid(int n, const real* x, real* y);
+
+// x = activation(x) for ACT_RELU (max(x, 0)) or ACT_SIGMOID; ACT_NONE does nothing
+void vactivate(int activation, int n, real* x);
+
+// y = exp(x - max(x)) / sum(exp(x - max(x)))
+// subtracting the maximum keeps exp from overflowing for large inputs
+void softmax(int n, const real* x, real* y);
+
+#endif
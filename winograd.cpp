@@ -0,0 +1,272 @@
+#include <vector>
+#include <algorithm>
+
+#include "winograd.h"
+
+//
+// transforms on a single tile
+//
+//   B^T = [ 1  0 -1  0 ]    G = [  1    0    0  ]    A^T = [ 1  1  1  0 ]
+//         [ 0  1  1  0 ]        [ 1/2  1/2  1/2 ]          [ 0  1 -1 -1 ]
+//         [ 0 -1  1  0 ]        [ 1/2 -1/2  1/2 ]
+//         [ 0  1  0 -1 ]        [  0    0    1  ]
+//
+
+// u = G g G^T (g 3x3, u 4x4)
+static inline void filter_tile(const real* g, real* u) {
+  real h[12];
+  for (int j = 0; j < 3; j++) {
+    h[0*3+j] = g[0*3+j];
+    h[1*3+j] = 0.5*(g[0*3+j] + g[1*3+j] + g[2*3+j]);
+    h[2*3+j] = 0.5*(g[0*3+j] - g[1*3+j] + g[2*3+j]);
+    h[3*3+j] = g[2*3+j];
+  }
+  for (int i = 0; i < 4; i++) {
+    u[i*4+0] = h[i*3+0];
+    u[i*4+1] = 0.5*(h[i*3+0] + h[i*3+1] + h[i*3+2]);
+    u[i*4+2] = 0.5*(h[i*3+0] - h[i*3+1] + h[i*3+2]);
+    u[i*4+3] = h[i*3+2];
+  }
+}
+
+// g = G^T u G (adjoint of filter_tile)
+static inline void filter_tile_adjoint(const real* u, real* g) {
+  real p[12];
+  for (int j = 0; j < 4; j++) {
+    p[0*4+j] = u[0*4+j] + 0.5*(u[1*4+j] + u[2*4+j]);
+    p[1*4+j] = 0.5*(u[1*4+j] - u[2*4+j]);
+    p[2*4+j] = 0.5*(u[1*4+j] + u[2*4+j]) + u[3*4+j];
+  }
+  for (int i = 0; i < 3; i++) {
+    g[i*3+0] = p[i*4+0] + 0.5*(p[i*4+1] + p[i*4+2]);
+    g[i*3+1] = 0.5*(p[i*4+1] - p[i*4+2]);
+    g[i*3+2] = 0.5*(p[i*4+1] + p[i*4+2]) + p[i*4+3];
+  }
+}
+
+//
+// transforms over whole images
+// tile (ti, tj) produces output rows 2ti, 2ti+1 and columns 2tj, 2tj+1 from
+// input rows 2ti-1 .. 2ti+2 and columns 2tj-1 .. 2tj+2
+// images are processed one row of tiles at a time: the row part of each 
+// transform is applied to whole image rows, and the column part writes each 
+// of the 16 transformed values for consecutive tiles to consecutive memory
+//
+
+// filter transform
+void winograd_filter(const real* g, int co, int ci, real* U) {
+  real u[16];
+  for (int o = 0; o < co; o++) {
+    for (int i = 0; i < ci; i++) {
+      filter_tile(g + (o*ci + i)*9, u);
+      for (int xi = 0; xi < 16; xi++) {
+        U[ (xi*co + o)*ci + i ] = u[xi];
+      }
+    }
+  }
+}
+
+// adjoint of filter transform
+void winograd_filter_adjoint(const real* dU, int co, int ci, real* dg) {
+  real u[16], g[9];
+  for (int o = 0; o < co; o++) {
+    for (int i = 0; i < ci; i++) {
+      for (int xi = 0; xi < 16; xi++) {
+        u[xi] = dU[ (xi*co + o)*ci + i ];
+      }
+      filter_tile_adjoint(u, g);
+      real* dgi = dg + (o*ci + i)*9;
+      for (int k = 0; k < 9; k++) {
+        dgi[k] += g[k];
+      }
+    }
+  }
+}
+
+// input transform
+void winograd_input(const real* x, int c, int m, int n, real* V, int ld, int t0) {
+  int tm = (m+1)/2, tn = (n+1)/2;
+  // padded input rows (column 0 is input column -1) and rows of B^T d
+  int w = 2*tn + 2;
+  std::vector<real> d(4*w, 0.0), s(4*w);
+  for (int ch = 0; ch < c; ch++) {
+    const real* xc = x + ch*m*n;
+    for (int ti = 0; ti < tm; ti++) {
+      // gather input rows 2ti-1 .. 2ti+2 with zero padding
+      for (int i = 0; i < 4; i++) {
+        int row = 2*ti - 1 + i;
+        real* di = &d[i*w];
+        if (row >= 0 && row < m) {
+          std::copy(xc + row*n, xc + (row+1)*n, di + 1);
+          std::fill(di + n + 1, di + w, 0.0);
+        }
+        else {
+          std::fill(di, di + w, 0.0);
+        }
+      }
+      // rows of B^T d
+      for (int j = 0; j < w; j++) {
+        s[0*w+j] = d[0*w+j] - d[2*w+j];
+        s[1*w+j] = d[1*w+j] + d[2*w+j];
+        s[2*w+j] = d[2*w+j] - d[1*w+j];
+        s[3*w+j] = d[1*w+j] - d[3*w+j];
+      }
+      // columns of (B^T d) B, for each tile in row
+      int t = t0 + ti*tn;
+      for (int i = 0; i < 4; i++) {
+        const real* si = &s[i*w];
+        real* v0 = V + ((4*i+0)*c + ch)*ld + t;
+        real* v1 = V + ((4*i+1)*c + ch)*ld + t;
+        real* v2 = V + ((4*i+2)*c + ch)*ld + t;
+        real* v3 = V + ((4*i+3)*c + ch)*ld + t;
+        for (int tj = 0; tj < tn; tj++) {
+          const real* sj = si + 2*tj;
+          v0[tj] = sj[0] - sj[2];
+          v1[tj] = sj[1] + sj[2];
+          v2[tj] = sj[2] - sj[1];
+          v3[tj] = sj[1] - sj[3];
+        }
+      }
+    }
+  }
+}
+
+// adjoint of input transform
+void winograd_input_adjoint(const real* V, int c, int m, int n, int ld, int t0, real* x) {
+  int tm = (m+1)/2, tn = (n+1)/2;
+  // rows of B dV (4 values per tile), and padded rows of B dV B^T summed 
+  // over tiles in row (column 0 is input column -1)
+  int wq = 4*tn;
+  int w = 2*tn + 2;
+  std::vector<real> q(4*wq), d(4*w);
+  for (int ch = 0; ch < c; ch++) {
+    real* xc = x + ch*m*n;
+    for (int ti = 0; ti < tm; ti++) {
+      int t = t0 + ti*tn;
+      // rows of B dV, stored as 4 values per tile
+      for (int j = 0; j < 4; j++) {
+        const real* v0 = V + ((0*4+j)*c + ch)*ld + t;
+        const real* v1 = V + ((1*4+j)*c + ch)*ld + t;
+        const real* v2 = V + ((2*4+j)*c + ch)*ld + t;
+        const real* v3 = V + ((3*4+j)*c + ch)*ld + t;
+        for (int tj = 0; tj < tn; tj++) {
+          q[0*wq + 4*tj+j] = v0[tj];
+          q[1*wq + 4*tj+j] = v1[tj] - v2[tj] + v3[tj];
+          q[2*wq + 4*tj+j] = v1[tj] + v2[tj] - v0[tj];
+          q[3*wq + 4*tj+j] = -v3[tj];
+        }
+      }
+      // columns of (B dV) B^T, adding overlapping tiles
+      std::fill(d.begin(), d.end(), 0.0);
+      for (int i = 0; i < 4; i++) {
+        const real* qi = &q[i*wq];
+        real* di = &d[i*w];
+        for (int tj = 0; tj < tn; tj++) {
+          const real* qj = qi + 4*tj;
+          di[2*tj+0] += qj[0];
+          di[2*tj+1] += qj[1] - qj[2] + qj[3];
+          di[2*tj+2] += qj[1] + qj[2] - qj[0];
+          di[2*tj+3] -= qj[3];
+        }
+      }
+      // add rows back onto input, dropping padding
+      for (int i = 0; i < 4; i++) {
+        int row = 2*ti - 1 + i;
+        if (row < 0 || row >= m) continue;
+        const real* di = &d[i*w] + 1;
+        real* xr = xc + row*n;
+        for (int j = 0; j < n; j++) {
+          xr[j] += di[j];
+        }
+      }
+    }
+  }
+}
+
+// output transform
+void winograd_output(const real* M, int c, int m, int n, int ld, int t0, real* y) {
+  int tm = (m+1)/2, tn = (n+1)/2;
+  // rows of A^T M (4 values per tile), and two output rows (padded to even width)
+  int w = 4*tn;
+  std::vector<real> r(2*w), yr(4*tn);
+  for (int ch = 0; ch < c; ch++) {
+    real* yc = y + ch*m*n;
+    for (int ti = 0; ti < tm; ti++) {
+      int t = t0 + ti*tn;
+      for (int j = 0; j < 4; j++) {
+        const real* m0 = M + ((0*4+j)*c + ch)*ld + t;
+        const real* m1 = M + ((1*4+j)*c + ch)*ld + t;
+        const real* m2 = M + ((2*4+j)*c + ch)*ld + t;
+        const real* m3 = M + ((3*4+j)*c + ch)*ld + t;
+        for (int tj = 0; tj < tn; tj++) {
+          r[0*w + 4*tj+j] = m0[tj] + m1[tj] + m2[tj];
+          r[1*w + 4*tj+j] = m1[tj] - m2[tj] - m3[tj];
+        }
+      }
+      for (int i = 0; i < 2; i++) {
+        const real* ri = &r[i*w];
+        real* yi = &yr[i*2*tn];
+        for (int tj = 0; tj < tn; tj++) {
+          const real* rj = ri + 4*tj;
+          yi[2*tj+0] = rj[0] + rj[1] + rj[2];
+          yi[2*tj+1] = rj[1] - rj[2] - rj[3];
+        }
+      }
+      // last row/column of tiles may hang over edge for odd dimensions
+      for (int i = 0; i < 2 && 2*ti+i < m; i++) {
+        const real* yi = &yr[i*2*tn];
+        real* dst = yc + (2*ti+i)*n;
+        for (int j = 0; j < n; j++) {
+          dst[j] += yi[j];
+        }
+      }
+    }
+  }
+}
+
+// adjoint of output transform
+void winograd_output_adjoint(const real* dy, int c, int m, int n, real* M, int ld, int t0) {
+  int tm = (m+1)/2, tn = (n+1)/2;
+  // two output rows (zero padded to even width), and rows of A dy
+  int w = 2*tn;
+  std::vector<real> yr(2*w), r(4*w);
+  for (int ch = 0; ch < c; ch++) {
+    const real* yc = dy + ch*m*n;
+    for (int ti = 0; ti < tm; ti++) {
+      for (int i = 0; i < 2; i++) {
+        int row = 2*ti + i;
+        real* yi = &yr[i*w];
+        if (row < m) {
+          std::copy(yc + row*n, yc + (row+1)*n, yi);
+          std::fill(yi + n, yi + w, 0.0);
+        }
+        else {
+          std::fill(yi, yi + w, 0.0);
+        }
+      }
+      // rows of A dy
+      for (int j = 0; j < w; j++) {
+        r[0*w+j] = yr[0*w+j];
+        r[1*w+j] = yr[0*w+j] + yr[1*w+j];
+        r[2*w+j] = yr[0*w+j] - yr[1*w+j];
+        r[3*w+j] = -yr[1*w+j];
+      }
+      // columns of (A dy) A^T, for each tile in row
+      int t = t0 + ti*tn;
+      for (int i = 0; i < 4; i++) {
+        const real* ri = &r[i*w];
+        real* m0 = M + ((4*i+0)*c + ch)*ld + t;
+        real* m1 = M + ((4*i+1)*c + ch)*ld + t;
+        real* m2 = M + ((4*i+2)*c + ch)*ld + t;
+        real* m3 = M + ((4*i+3)*c + ch)*ld + t;
+        for (int tj = 0; tj < tn; tj++) {
+          const real* rj = ri + 2*tj;
+          m0[tj] = rj[0];
+          m1[tj] = rj[0] + rj[1];
+          m2[tj] = rj[0] - rj[1];
+          m3[tj] = -rj[1];
+        }
+      }
+    }
+  }
+}
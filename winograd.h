@@ -0,0 +1,41 @@
+// Winograd minimal filtering F(2x2,3x3) for 3x3, stride 1, zero padded convolution
+//
+// each 2x2 tile of output is computed from a 4x4 tile of input as
+//   Y = A^T [ (G g G^T) .* (B^T d B) ] A
+// transformed quantities are stored as 16 matrices (one per point of the 4x4
+// tile), so that summing over channels is a matrix multiply for each point:
+//   filter  U: 16 x out_channels x in_channels
+//   input   V: 16 x channels x ld (one column per tile)
+//   output  M: 16 x channels x ld
+// images are stored channel by channel (c x m x n), and input and output
+// images have the same dimensions m x n
+
+#ifndef _WINOGRAD
+#define _WINOGRAD
+
+#include "real.h"
+
+// number of 2x2 tiles covering an m x n image
+inline int winograd_tiles(int m, int n) {
+  return ((m+1)/2) * ((n+1)/2);
+}
+
+// filter transform: kernel g (co x ci x 3 x 3) into U
+void winograd_filter(const real* g, int co, int ci, real* U);
+
+// adjoint of filter transform: accumulate G^T dU G into kernel partials dg
+void winograd_filter_adjoint(const real* dU, int co, int ci, real* dg);
+
+// input transform: image x into columns t0, t0+1, ... of V
+void winograd_input(const real* x, int c, int m, int n, real* V, int ld, int t0);
+
+// adjoint of input transform: accumulate B dV B^T into image x
+void winograd_input_adjoint(const real* V, int c, int m, int n, int ld, int t0, real* x);
+
+// output transform: add A^T M A from columns t0, t0+1, ... of M into image y
+void winograd_output(const real* M, int c, int m, int n, int ld, int t0, real* y);
+
+// adjoint of output transform: A dy A^T from image dy into columns of M
+void winograd_output_adjoint(const real* dy, int c, int m, int n, real* M, int ld, int t0);
+
+#endif